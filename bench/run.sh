@@ -0,0 +1,116 @@
+#!/bin/sh
+# Generates the benchmark scripts into build/ and runs every benchmark
+# binary that `make bench` produced against them.
+
+set -e
+
+BUILD=./build
+
+gen_arith() {
+  awk 'BEGIN {
+    print "var a = 0;";
+    print "var b = 1;";
+    for (i = 0; i < 200000; i++) print "a = a + b * 2 - b / 3;";
+    print "print a;";
+  }' > "$BUILD/bench_arith.clox"
+}
+
+gen_globals() {
+  awk 'BEGIN {
+    print "var count = 0;";
+    print "var total = 0;";
+    print "var step = 3;";
+    for (i = 0; i < 100000; i++) {
+      print "count = count + 1;";
+      print "total = total + count;";
+      print "total = total - step * 2;";
+    }
+    print "print total;";
+  }' > "$BUILD/bench_globals.clox"
+}
+
+# The globals script with its hot loop body inside a block, so every
+# variable is a stack slot.
+gen_locals() {
+  awk 'BEGIN {
+    print "{";
+    print "var count = 0;";
+    print "var total = 0;";
+    print "var step = 3;";
+    for (i = 0; i < 100000; i++) {
+      print "count = count + 1;";
+      print "total = total + count;";
+      print "total = total - step * 2;";
+    }
+    print "print total;";
+    print "}";
+  }' > "$BUILD/bench_locals.clox"
+}
+
+# A counted loop, where the condition and the jump back are most of the
+# work.
+gen_loop() {
+  cat > "$BUILD/bench_loop.clox" <<'EOF'
+{
+  var total = 0;
+  for (var i = 0; i < 1000000; i = i + 1) {
+    total = total + i;
+  }
+  print total;
+}
+EOF
+}
+
+gen_strings() {
+  awk 'BEGIN {
+    for (i = 0; i < 50000; i++) printf "\"string number %d\";\n", i;
+  }' > "$BUILD/bench_strings.clox"
+}
+
+# Two concatenations per line whose results die right away, the
+# allocation pattern the nursery is for.
+gen_alloc() {
+  awk 'BEGIN {
+    print "var s = \"short\";";
+    print "var t = \"lived\";";
+    print "var u = \"\";";
+    for (i = 0; i < 200000; i++) printf "u = s + \"%d\" + t;\n", i;
+    print "print u;";
+  }' > "$BUILD/bench_alloc.clox"
+}
+
+# Builds a 10MB string a hundred characters at a time, then compares it,
+# which flattens it once.
+gen_concat() {
+  awk 'BEGIN {
+    piece = "";
+    for (i = 0; i < 10; i++) piece = piece "0123456789";
+    print "var s = \"\";";
+    for (i = 0; i < 100000; i++) printf "s = s + \"%s\";\n", piece;
+    print "print s == s + \"\";";
+  }' > "$BUILD/bench_concat.clox"
+}
+
+run() {
+  for bin in "$BUILD"/clox_bench*; do
+    printf "%-28s %-20s " "$(basename "$bin")" "$(basename "$1")"
+    "$bin" "$1" 2>&1 >/dev/null | grep '\[stats\]' | grep -v -- '->' |
+      tr '\n' ' '
+    echo
+  done
+}
+
+gen_arith
+gen_globals
+gen_locals
+gen_loop
+gen_strings
+gen_alloc
+gen_concat
+run "$BUILD/bench_arith.clox"
+run "$BUILD/bench_globals.clox"
+run "$BUILD/bench_locals.clox"
+run "$BUILD/bench_loop.clox"
+run "$BUILD/bench_strings.clox"
+run "$BUILD/bench_alloc.clox"
+run "$BUILD/bench_concat.clox"
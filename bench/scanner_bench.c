@@ -0,0 +1,88 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+/*
+Scanner throughput, in MB/s. Each sample is repeated to a few MB and
+scanned to the end several times. "code" is dense statements like the
+generated benchmark scripts, "commented" is indented code with comments
+and longer strings.
+*/
+
+#define SOURCE_SIZE (8 * 1024 * 1024)
+#define ROUNDS 5
+
+static const char* code =
+  "var total = 0;\n"
+  "var name = \"scanner benchmark\";\n"
+  "if (total >= 10 and name != nil) print name;\n"
+  "while (total < 100) total = total + 1.5;\n"
+  "for (var i = 0; i <= 10; i = i + 1) print i * 2 - 3 / 4;\n"
+  "fun area(width, height) { return width * height; }\n"
+  "class Shape { init() { this.sides = false or true; } }\n";
+
+static const char* commented =
+  "// Sums the first hundred numbers, one at a time, and prints the\n"
+  "// running total together with a description of what it means.\n"
+  "fun sum(limit) {\n"
+  "    var total = 0;\n"
+  "    for (var i = 0; i < limit; i = i + 1) {\n"
+  "        total = total + i; // keeps a running total\n"
+  "    }\n"
+  "    print \"the total of all numbers below the limit is\";\n"
+  "    return total;\n"
+  "}\n"
+  "\n";
+
+static double now(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool bench(const char* label, const char* snippet){
+  size_t length = strlen(snippet);
+  size_t copies = SOURCE_SIZE / length;
+  char* source = malloc(copies * length + 1);
+  if(source == NULL) return false;
+  for(size_t i = 0; i < copies; i++){
+    memcpy(source + i * length, snippet, length);
+  }
+  source[copies * length] = '\0';
+  size_t size = copies * length;
+
+  double best = 0;
+  long tokens = 0;
+  for(int round = 0; round < ROUNDS; round++){
+    initScanner(source);
+    tokens = 0;
+    double start = now();
+    for(;;){
+      Token token = scanToken();
+      if(token.type == TOKEN_EOF) break;
+      if(token.type == TOKEN_ERROR){
+        fprintf(stderr, "scan error on line %d\n", token.line);
+        free(source);
+        return false;
+      }
+      tokens++;
+    }
+    double elapsed = now() - start;
+    if(round == 0 || elapsed < best) best = elapsed;
+  }
+
+  printf("scanner %-10s %.1f MB, %ld tokens, %.0f MB/s\n", label,
+         size / 1e6, tokens, size / best / 1e6);
+  free(source);
+  return true;
+}
+
+int main(){
+  if(!bench("code", code)) return 1;
+  if(!bench("commented", commented)) return 1;
+  return 0;
+}
@@ -0,0 +1,211 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "hash.h"
+
+/*
+Compiled chunks are cached on disk, keyed by a hash of the source text
+and BYTECODE_VERSION, so a script that did not change since its last run
+skips the scanner and compiler.
+
+  $CLOX_CACHE_DIR, or $XDG_CACHE_HOME/clox, or ~/.cache/clox
+    <hash>-<length>-v<version>.cloxc
+    counters
+
+Entries are written to a temporary file named after the writing process
+and renamed over the final name, so concurrent writers never leave a
+half written entry behind and readers see either no file or a whole
+one. A hit touches its entry's mtime, and every store drops the entries
+used longest ago until at most CACHE_MAX_ENTRIES of them, taking up at
+most CACHE_MAX_BYTES, are left. Entries of older bytecode versions are
+never hit again, so they go first.
+
+The counters file holds the hit and miss counts as two uint64 records,
+updated in place under an flock so concurrent runs don't lose ticks.
+
+Setting CLOX_CACHE_DIR to an empty string turns the cache off.
+*/
+
+#define CACHE_MAX_ENTRIES 256
+#define CACHE_MAX_BYTES (64 * 1024 * 1024)
+
+// Records in the counters file.
+#define COUNT_HITS 0
+#define COUNT_MISSES 1
+
+static bool cacheDir(char* path, size_t size){
+  const char* dir = getenv("CLOX_CACHE_DIR");
+  if(dir != NULL){
+    if(dir[0] == '\0') return false;
+    snprintf(path, size, "%s", dir);
+  } else if((dir = getenv("XDG_CACHE_HOME")) != NULL && dir[0] != '\0'){
+    snprintf(path, size, "%s/clox", dir);
+  } else if((dir = getenv("HOME")) != NULL && dir[0] != '\0'){
+    snprintf(path, size, "%s/.cache", dir);
+    mkdir(path, 0755);
+    snprintf(path, size, "%s/.cache/clox", dir);
+  } else {
+    return false;
+  }
+  return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static bool entryPath(const char* source, char* path, size_t size){
+  char dir[PATH_MAX];
+  if(!cacheDir(dir, sizeof(dir))) return false;
+  size_t length = strlen(source);
+  int written = snprintf(path, size, "%s/%016llx-%zx-v%d.cloxc", dir,
+                         (unsigned long long)hashBytes(source, length),
+                         length, BYTECODE_VERSION);
+  return written > 0 && (size_t)written < size;
+}
+
+// dir/name into path, false when it does not fit rather than opening a
+// truncated path.
+static bool cacheFile(const char* dir, const char* name, char* path,
+                      size_t size){
+  int written = snprintf(path, size, "%s/%s", dir, name);
+  return written > 0 && (size_t)written < size;
+}
+
+static void count(int counter){
+  char dir[PATH_MAX];
+  char path[PATH_MAX];
+  if(!cacheDir(dir, sizeof(dir))) return;
+  if(!cacheFile(dir, "counters", path, sizeof(path))) return;
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if(fd < 0) return;
+  // Losing a tick is fine, the counters are only informational.
+  if(flock(fd, LOCK_EX) == 0){
+    off_t offset = counter * (off_t)sizeof(uint64_t);
+    uint64_t value;
+    if(pread(fd, &value, sizeof(value), offset) != sizeof(value)) value = 0;
+    value++;
+    if(pwrite(fd, &value, sizeof(value), offset) != sizeof(value)){}
+  }
+  close(fd);
+}
+
+static uint64_t readCount(const char* dir, int counter){
+  char path[PATH_MAX];
+  if(!cacheFile(dir, "counters", path, sizeof(path))) return 0;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return 0;
+  uint64_t value;
+  if(flock(fd, LOCK_SH) != 0 ||
+     pread(fd, &value, sizeof(value), counter * (off_t)sizeof(uint64_t)) !=
+       sizeof(value)){
+    value = 0;
+  }
+  close(fd);
+  return value;
+}
+
+typedef struct {
+  char name[NAME_MAX + 1];
+  time_t used;
+  off_t size;
+} CacheEntry;
+
+static int compareUse(const void* a, const void* b){
+  time_t usedA = ((const CacheEntry*)a)->used;
+  time_t usedB = ((const CacheEntry*)b)->used;
+  return (usedA > usedB) - (usedA < usedB);
+}
+
+static bool isEntry(const char* name){
+  size_t length = strlen(name);
+  return length > 6 && strcmp(name + length - 6, ".cloxc") == 0;
+}
+
+// Removes the entries used longest ago until the cache is within its
+// bounds again.
+static void evict(const char* dir){
+  DIR* handle = opendir(dir);
+  if(handle == NULL) return;
+
+  CacheEntry* entries = NULL;
+  int count = 0;
+  int capacity = 0;
+  long long bytes = 0;
+  struct dirent* file;
+  while((file = readdir(handle)) != NULL){
+    char path[PATH_MAX];
+    struct stat st;
+    if(!isEntry(file->d_name) ||
+       !cacheFile(dir, file->d_name, path, sizeof(path)) ||
+       stat(path, &st) != 0){
+      continue;
+    }
+    if(count == capacity){
+      capacity = capacity < 8 ? 8 : capacity * 2;
+      entries = realloc(entries, sizeof(CacheEntry) * capacity);
+      if(entries == NULL) exit(1);
+    }
+    CacheEntry* entry = &entries[count++];
+    snprintf(entry->name, sizeof(entry->name), "%s", file->d_name);
+    entry->used = st.st_mtime;
+    entry->size = st.st_size;
+    bytes += st.st_size;
+  }
+  closedir(handle);
+
+  qsort(entries, count, sizeof(CacheEntry), compareUse);
+  for(int i = 0; i < count; i++){
+    if(count - i <= CACHE_MAX_ENTRIES && bytes <= CACHE_MAX_BYTES) break;
+    char path[PATH_MAX];
+    if(cacheFile(dir, entries[i].name, path, sizeof(path)) &&
+       remove(path) == 0){
+      bytes -= entries[i].size;
+    }
+  }
+  free(entries);
+}
+
+bool loadCachedChunk(const char* source, Chunk* chunk, Mapping* mapping){
+  char path[PATH_MAX];
+  if(!entryPath(source, path, sizeof(path))) return false;
+
+  if(tryLoadBytecode(path, chunk, mapping)){
+    // Marks the entry as recently used for evict().
+    utimensat(AT_FDCWD, path, NULL, 0);
+    count(COUNT_HITS);
+    return true;
+  }
+  count(COUNT_MISSES);
+  return false;
+}
+
+void storeCachedChunk(const char* source, Chunk* chunk){
+  char path[PATH_MAX];
+  char temp[PATH_MAX + 32];
+  if(!entryPath(source, path, sizeof(path))) return;
+
+  snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+  if(writeBytecode(chunk, temp) && rename(temp, path) != 0){
+    remove(temp);
+  }
+
+  char dir[PATH_MAX];
+  if(cacheDir(dir, sizeof(dir))) evict(dir);
+}
+
+void printCacheStats(){
+  char dir[PATH_MAX];
+  if(!cacheDir(dir, sizeof(dir))){
+    printf("cache disabled\n");
+    return;
+  }
+  printf("cache %s\n", dir);
+  printf("hits %llu\n", (unsigned long long)readCount(dir, COUNT_HITS));
+  printf("misses %llu\n", (unsigned long long)readCount(dir, COUNT_MISSES));
+}
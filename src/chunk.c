@@ -1,11 +1,17 @@
+#include <stdlib.h>
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
 void initChunk(Chunk* chunk){
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->feedback = NULL;
+  chunk->maxStack = 0;
   initValueArray(&chunk->constants);
 }
 
@@ -15,23 +21,254 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line){
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     chunk->code = GROW_ARRAY(uint8_t, chunk->code, 
         oldCapacity, chunk->capacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, 
-        oldCapacity, chunk->capacity);
   }
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count ++;
+
+  // Still on the same line as the previous byte.
+  if(chunk->lineCount > 0 &&
+     chunk->lines[chunk->lineCount - 1].line == line){
+    return;
+  }
+
+  if(chunk->lineCapacity < chunk->lineCount + 1){
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(LineStart, chunk->lines,
+        oldCapacity, chunk->lineCapacity);
+  }
+  LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = chunk->count - 1;
+  lineStart->line = line;
+}
+
+// Drops every byte from count onwards, and the line runs that only
+// covered those bytes.
+void truncateChunk(Chunk* chunk, int count){
+  chunk->count = count;
+  while(chunk->lineCount > 0 &&
+        chunk->lines[chunk->lineCount - 1].offset >= count){
+    chunk->lineCount--;
+  }
+}
+
+int getLine(Chunk* chunk, int offset){
+  int start = 0;
+  int end = chunk->lineCount - 1;
+  // Find the last run that starts at or before offset.
+  while(start < end){
+    int mid = (start + end + 1) / 2;
+    if(chunk->lines[mid].offset <= offset){
+      start = mid;
+    } else {
+      end = mid - 1;
+    }
+  }
+  return chunk->lineCount > 0 ? chunk->lines[start].line : 0;
 }
 
 void freeChunk(Chunk* chunk){
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  initValueArray(&chunk->constants);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
 
 int addConstant(Chunk* chunk, Value value){
+  // The value may be a string nothing else holds yet, keep it reachable
+  // in case growing the pool collects.
+  push(value);
   writeValueArray(&chunk->constants, value);
+  pop();
   return chunk->constants.count -1;
 }
 
+
+// Size in bytes of an instruction, opcode included.
+int opcodeLength(uint8_t opcode){
+  switch(opcode){
+    case OP_CONSTANT:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_KEEP:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+    case OP_ADD_SET_GLOBAL_POP:
+    case OP_SUBTRACT_SET_GLOBAL_POP:
+    case OP_CONCAT_N:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_POPN:
+    case OP_SET_LOCAL_POP:
+      return 2;
+    case OP_GLOBAL_ADD_CONSTANT:
+    case OP_GLOBAL_SUBTRACT_CONSTANT:
+    case OP_GLOBAL_MULTIPLY_CONSTANT:
+    case OP_GLOBAL_DIVIDE_CONSTANT:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+      return 3;
+    case OP_CONSTANT_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+      return 4;
+    case OP_FOR_STEP:
+      return 7;
+    default:
+      return 1;
+  }
+}
+
+// How many values the instruction at code takes off the stack and how
+// many it leaves there afterwards.
+void stackEffect(const uint8_t* code, int* pops, int* pushes){
+  *pops = 0;
+  *pushes = 0;
+  switch(code[0]){
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_LOCAL:
+    case OP_GLOBAL_ADD_CONSTANT:
+    case OP_GLOBAL_SUBTRACT_CONSTANT:
+    case OP_GLOBAL_MULTIPLY_CONSTANT:
+    case OP_GLOBAL_DIVIDE_CONSTANT:
+      *pushes = 1;
+      break;
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_JUMP_IF_FALSE:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+    case OP_SET_LOCAL:
+    case OP_DEFINE_GLOBAL_KEEP:
+      *pops = 1;
+      *pushes = 1;
+      break;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_EQUAL_NUM:
+    case OP_NOT_EQUAL_NUM:
+      *pops = 2;
+      *pushes = 1;
+      break;
+    case OP_PRINT:
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_POP:
+    case OP_SET_LOCAL_POP:
+    case OP_POP_JUMP_IF_FALSE:
+      *pops = 1;
+      break;
+    case OP_ADD_SET_GLOBAL_POP:
+    case OP_SUBTRACT_SET_GLOBAL_POP:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+      *pops = 2;
+      break;
+    case OP_CONCAT_N:
+      *pops = code[1];
+      *pushes = 1;
+      break;
+    case OP_POPN:
+      *pops = code[1];
+      break;
+    default:
+      break;
+  }
+}
+
+bool isJump(uint8_t opcode){
+  switch(opcode){
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_FOR_STEP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// The distance is always the last two bytes of a jump.
+static bool jumpsBack(uint8_t opcode){
+  return opcode == OP_LOOP || opcode == OP_FOR_STEP;
+}
+
+// Offset the jump at offset lands on.
+int jumpTarget(const uint8_t* code, int offset){
+  int end = offset + opcodeLength(code[offset]);
+  int distance = readUint16(&code[end - 2]);
+  return jumpsBack(code[offset]) ? end - distance : end + distance;
+}
+
+// Points the jump at offset to target. The caller checks the distance
+// fits in 16 bits.
+void setJumpTarget(uint8_t* code, int offset, int target){
+  int end = offset + opcodeLength(code[offset]);
+  int distance = jumpsBack(code[offset]) ? end - target : target - end;
+  code[end - 2] = (distance >> 8) & 0xff;
+  code[end - 1] = distance & 0xff;
+}
+
+// Follows the stack depth through code the compiler produced, where a
+// jump target has the same depth on every way in. Code after a jump that
+// never falls through picks up the depth a jump to it recorded.
+int maxStackDepth(Chunk* chunk){
+  int* depths = malloc(sizeof(int) * (chunk->count + 1));
+  if(depths == NULL) exit(1);
+  for(int offset = 0; offset < chunk->count; offset++) depths[offset] = -1;
+
+  int depth = 0;
+  int max = 0;
+  bool fallsThrough = true;
+  for(int offset = 0; offset < chunk->count;){
+    uint8_t* code = &chunk->code[offset];
+    if(!fallsThrough && depths[offset] != -1) depth = depths[offset];
+
+    int pops, pushes;
+    stackEffect(code, &pops, &pushes);
+    depth += pushes - pops;
+    if(depth > max) max = depth;
+
+    if(isJump(code[0])) depths[jumpTarget(chunk->code, offset)] = depth;
+    fallsThrough = code[0] != OP_JUMP && code[0] != OP_LOOP &&
+                   code[0] != OP_RETURN;
+    offset += opcodeLength(code[0]);
+  }
+  free(depths);
+  return max;
+}
@@ -1,9 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include "chunk.h"
 #include "scanner.h"
 #include "compiler.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
@@ -35,6 +39,20 @@ void emitByte(uint8_t byte);
 void endCompiler();
 void emitReturn();
 void emitConstant(Value value);
+static void initConstantIndex();
+static void truncateCode(int offset);
+
+// Bytecode taken out of the chunk to be put back further on.
+typedef struct {
+  uint8_t* code;
+  int* lines;
+  int length;
+} CodeSpan;
+
+static CodeSpan cutCode(int start);
+static void pasteCode(CodeSpan* span);
+static uint32_t makeConstant(Value value);
+static void freeConstantIndex();
 
 static void binary(bool canAssign);
 static void unary(bool canAssign);
@@ -43,6 +61,8 @@ static void literal(bool canAssign);
 static void handle_string(bool canAssign);
 static void grouping(bool canAssign);
 static void variable(bool canAssign);
+static void and_(bool canAssign);
+static void or_(bool canAssign);
 
 typedef void (*ParseFn)(bool canAssign);
 
@@ -80,6 +100,43 @@ static Chunk* compilingChunk;
 
 Parser parser;
 
+/*
+Maps constant values to their index in compilingChunk's pool so that
+each number or string is only stored once. Slots hold pool indices and
+are checked against the pool on every probe, so an index that constant
+folding dropped from the end of the pool is simply treated as a miss.
+*/
+typedef struct {
+  int* slots; // -1 when empty
+  int capacity;
+  int count;
+} ConstantIndex;
+
+static ConstantIndex constantIndex;
+
+// Offset where the expression currently being parsed starts. An infix
+// rule reads it on entry to find the bytecode of its left operand.
+static int exprStart = 0;
+// Size of the constant pool when that expression started.
+static int exprPoolStart = 0;
+
+// Offset of the OP_NOT that binary() appends to OP_EQUAL, OP_LESS or
+// OP_GREATER to build !=, >= and <=. A ! applied right after it cancels.
+static int negatedComparison = -1;
+
+// Offset of the OP_ADD or OP_CONCAT_N binary() emitted last, so the next
+// + in a chain can extend it.
+static int addChain = -1;
+
+// Offset of the OP_LESS, OP_GREATER or OP_EQUAL binary() emitted last. A
+// condition that ends in it branches on the comparison directly.
+static int comparison = -1;
+
+// Offset the last forward jump was patched to land on. The rewrites above
+// look back over code that was already emitted, none of them may merge
+// an instruction something jumps to into the one before it.
+static int lastTarget = -1;
+
 Compiler* current = NULL;
 
 static void parsePrecedence(Precedence);
@@ -88,6 +145,11 @@ static void initCompiler(Compiler* compiler){
   compiler->scopeDepth = 0;
   compiler->localCount = 0;
   current = compiler;
+  // Offsets left over from the previous chunk mean nothing in this one.
+  negatedComparison = -1;
+  addChain = -1;
+  comparison = -1;
+  lastTarget = -1;
 }
 
 ParseRule rules[] = {
@@ -109,6 +171,8 @@ ParseRule rules[] = {
   [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISION},
   [TOKEN_STRING] = {handle_string, binary, PREC_COMPARISION},
   [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
+  [TOKEN_AND] = {NULL, and_, PREC_AND},
+  [TOKEN_OR] = {NULL, or_, PREC_OR},
   [TOKEN_EOF] = {NULL, NULL, PREC_NONE}
 };
 
@@ -120,6 +184,15 @@ Chunk* currentChunk(){
   return compilingChunk;
 }
 
+void markCompilerRoots(){
+  if(compilingChunk != NULL){
+    ValueArray* constants = &compilingChunk->constants;
+    for(int i = 0; i < constants->count; i++){
+      markValue(constants->values[i]);
+    }
+  }
+}
+
 static bool check(TokenType type) {
   return parser.current.type == type;
 }
@@ -153,14 +226,291 @@ static void block(){
 static void beginScope(){
   current->scopeDepth ++;
 }
+
+// Pops the locals declared in the scope being closed, all of them in one
+// instruction when there are several.
 static void endScope(){
   current->scopeDepth --;
+  int count = 0;
+  while(current->localCount > 0 &&
+        current->locals[current->localCount - 1].depth >
+          current->scopeDepth){
+    current->localCount--;
+    count++;
+  }
+  while(count > 1){
+    int popped = count < UINT8_MAX ? count : UINT8_MAX;
+    emitBytes(OP_POPN, (uint8_t)popped);
+    count -= popped;
+  }
+  if(count == 1) emitByte(OP_POP);
+}
+
+static int emitJump(uint8_t instruction){
+  emitByte(instruction);
+  emitByte(0xff);
+  emitByte(0xff);
+  return currentChunk()->count - 3;
+}
+
+// Points the jump at offset to the next instruction emitted.
+static void patchJump(int offset){
+  int target = currentChunk()->count;
+  if(target - (offset + 3) > UINT16_MAX){
+    error("Too much code to jump over.");
+  }
+  setJumpTarget(currentChunk()->code, offset, target);
+  lastTarget = target;
+}
+
+static void emitLoop(int loopStart){
+  emitByte(OP_LOOP);
+  int offset = currentChunk()->count + 2 - loopStart;
+  if(offset > UINT16_MAX) error("Loop body too large.");
+  emitByte((offset >> 8) & 0xff);
+  emitByte(offset & 0xff);
+}
+
+/*
+Jumps when the condition just compiled is false, popping it. A condition
+that ends in a comparison is not turned into a bool first: the
+comparison is replaced by a jump that does the compare itself, so
+`i < n` costs one dispatch instead of OP_LESS, OP_JUMP_IF_FALSE, OP_POP.
+The negated forms jump on the comparison being true.
+*/
+static int emitConditionJump(){
+  Chunk* chunk = currentChunk();
+  int end = chunk->count;
+  if(lastTarget != end && comparison == end - 1){
+    uint8_t jump;
+    switch(chunk->code[comparison]){
+      case OP_LESS: jump = OP_JUMP_IF_NOT_LESS; break;
+      case OP_GREATER: jump = OP_JUMP_IF_NOT_GREATER; break;
+      default: jump = OP_JUMP_IF_NOT_EQUAL; break;
+    }
+    truncateCode(end - 1);
+    return emitJump(jump);
+  }
+  if(lastTarget != end && negatedComparison == end - 1){
+    uint8_t jump;
+    switch(chunk->code[end - 2]){
+      case OP_LESS: jump = OP_JUMP_IF_LESS; break;
+      case OP_GREATER: jump = OP_JUMP_IF_GREATER; break;
+      default: jump = OP_JUMP_IF_EQUAL; break;
+    }
+    truncateCode(end - 2);
+    return emitJump(jump);
+  }
+  return emitJump(OP_POP_JUMP_IF_FALSE);
+}
+
+static void ifStatement(){
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  int thenJump = emitConditionJump();
+  statement();
+  if(match(TOKEN_ELSE)){
+    int elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump);
+    statement();
+    patchJump(elseJump);
+  } else {
+    patchJump(thenJump);
+  }
+}
+
+static void whileStatement(){
+  int loopStart = currentChunk()->count;
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  int exitJump = emitConditionJump();
+  statement();
+  emitLoop(loopStart);
+  patchJump(exitJump);
+}
+
+static void varDeclaration();
+
+/*
+Counted loops. A for loop shaped like
+
+  for (var i = a; i < n; i = i + c) body
+
+with c a number constant, n a number constant or a local, and a body
+that assigns neither i nor n, ends in one OP_FOR_STEP instead of the
+increment and the jump back to the condition. It adds c to i, compares
+i to n and jumps to the start of the body while the condition holds.
+The condition is still compiled in front of the loop and checked once
+on entry. That is where a counter or bound that is not a number fails,
+after it the step only ever adds a number to a number. Any other shape,
+or a body that assigns the counter or the bound, keeps the plain loop.
+*/
+typedef struct {
+  int counter;  // local slot
+  int bound;    // local slot, or constant index with FOR_STEP_CONSTANT_BOUND
+  uint8_t mode;
+  int step;     // constant index
+} CountedLoop;
+
+// The condition compiled to [OP_GET_LOCAL counter] [bound] [fused jump].
+static bool matchCountedCondition(int start, CountedLoop* loop){
+  Chunk* chunk = currentChunk();
+  uint8_t* code = &chunk->code[start];
+  if(chunk->count - start != 7) return false;
+  if(code[0] != OP_GET_LOCAL || code[1] != loop->counter) return false;
+
+  if(code[2] == OP_GET_LOCAL && code[3] != loop->counter){
+    loop->mode = 0;
+  } else if(code[2] == OP_CONSTANT &&
+            IS_NUMBER(chunk->constants.values[code[3]])){
+    loop->mode = FOR_STEP_CONSTANT_BOUND;
+  } else {
+    return false;
+  }
+  loop->bound = code[3];
+
+  // The fused jump leaves the loop when the condition fails.
+  switch(code[4]){
+    case OP_JUMP_IF_NOT_LESS: loop->mode |= FOR_STEP_LESS; break;
+    case OP_JUMP_IF_GREATER: loop->mode |= FOR_STEP_LESS_EQUAL; break;
+    case OP_JUMP_IF_NOT_GREATER: loop->mode |= FOR_STEP_GREATER; break;
+    case OP_JUMP_IF_LESS: loop->mode |= FOR_STEP_GREATER_EQUAL; break;
+    default: return false;
+  }
+  return true;
+}
+
+// The increment compiled to i = i + c or i = i - c, then the OP_POP.
+// x - c and x + -c are the same IEEE operation.
+static bool matchCountedStep(CodeSpan* increment, CountedLoop* loop){
+  uint8_t* code = increment->code;
+  if(increment->length != 8) return false;
+  if(code[0] != OP_GET_LOCAL || code[1] != loop->counter ||
+     code[2] != OP_CONSTANT ||
+     code[5] != OP_SET_LOCAL || code[6] != loop->counter ||
+     code[7] != OP_POP){
+    return false;
+  }
+  Value step = currentChunk()->constants.values[code[3]];
+  if(!IS_NUMBER(step)) return false;
+
+  if(code[4] == OP_ADD){
+    loop->step = code[3];
+    return true;
+  }
+  if(code[4] == OP_SUBTRACT){
+    uint32_t negated = makeConstant(NUMBER_VAL(-AS_NUMBER(step)));
+    if(negated > UINT8_MAX) return false;
+    loop->step = negated;
+    return true;
+  }
+  return false;
+}
+
+// Whether any instruction from start on stores to the local slot.
+static bool assignsLocal(int start, int slot){
+  Chunk* chunk = currentChunk();
+  for(int offset = start; offset < chunk->count;){
+    uint8_t opcode = chunk->code[offset];
+    if((opcode == OP_SET_LOCAL || opcode == OP_FOR_STEP) &&
+       chunk->code[offset + 1] == slot){
+      return true;
+    }
+    offset += opcodeLength(opcode);
+  }
+  return false;
+}
+
+static void emitForStep(CountedLoop* loop, int bodyStart){
+  emitBytes(OP_FOR_STEP, (uint8_t)loop->counter);
+  emitBytes((uint8_t)loop->step, (uint8_t)loop->bound);
+  emitByte(loop->mode);
+  int offset = currentChunk()->count + 2 - bodyStart;
+  if(offset > UINT16_MAX) error("Loop body too large.");
+  emitByte((offset >> 8) & 0xff);
+  emitByte(offset & 0xff);
+}
+
+// The increment is compiled where it is written and then moved behind
+// the body, where it runs. An iteration is the condition, the body, the
+// increment and one jump back.
+static void forStatement(){
+  beginScope();
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  CountedLoop loop = {.counter = -1};
+  if(match(TOKEN_SEMICOLON)){
+    // No initializer.
+  } else if(match(TOKEN_VAR)){
+    varDeclaration();
+    loop.counter = current->localCount - 1;
+  } else {
+    expressionStatement();
+  }
+
+  int loopStart = currentChunk()->count;
+  int exitJump = -1;
+  bool counted = false;
+  if(!match(TOKEN_SEMICOLON)){
+    expression();
+    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+    exitJump = emitConditionJump();
+    counted = loop.counter >= 0 && matchCountedCondition(loopStart, &loop);
+  }
+
+  CodeSpan increment = {NULL, NULL, 0};
+  if(!match(TOKEN_RIGHT_PAREN)){
+    int incrementStart = currentChunk()->count;
+    expression();
+    emitByte(OP_POP);
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    increment = cutCode(incrementStart);
+    // Whatever the increment's own jumps land on moved out with it.
+    lastTarget = incrementStart;
+  }
+
+  counted = counted && increment.code != NULL &&
+            matchCountedStep(&increment, &loop);
+
+  int bodyStart = currentChunk()->count;
+  statement();
+  if(counted && (assignsLocal(bodyStart, loop.counter) ||
+                 (!(loop.mode & FOR_STEP_CONSTANT_BOUND) &&
+                  assignsLocal(bodyStart, loop.bound)))){
+    counted = false;
+  }
+
+  if(counted){
+    free(increment.code);
+    free(increment.lines);
+    emitForStep(&loop, bodyStart);
+  } else {
+    if(increment.code != NULL){
+      pasteCode(&increment);
+      lastTarget = currentChunk()->count;
+    }
+    emitLoop(loopStart);
+  }
+  if(exitJump != -1) patchJump(exitJump);
+  endScope();
 }
 
 static void statement(){
   if(match(TOKEN_PRINT)){
     printStatement();
   }
+  else if(match(TOKEN_IF)){
+    ifStatement();
+  }
+  else if(match(TOKEN_WHILE)){
+    whileStatement();
+  }
+  else if(match(TOKEN_FOR)){
+    forStatement();
+  }
   else if (match(TOKEN_LEFT_BRACE)){
     beginScope();
     block();
@@ -192,24 +542,73 @@ static void synchronize() {
   }
 }
 
-static uint32_t identifierConstant(Token* name){
-  return addConstant(
-      currentChunk(), 
-      OBJ_VAL(
-        copyString(
-          name->start, name->length  
-        )
-      )
-  );
+// Globals are resolved to their VM slot here, so the emitted opcodes
+// index straight into vm.globalValues instead of hashing the name.
+static uint32_t identifierSlot(Token* name){
+  int slot = globalSlot(copyString(name->start, name->length));
+  if(slot > UINT24_MAX){
+    error("Too many global variables.");
+    return 0;
+  }
+  return slot;
+}
+
+// Emits the one byte form of an instruction when the operand fits and
+// the 24 bit form otherwise.
+static void emitWithOperand(uint8_t op, uint8_t longOp, uint32_t operand){
+  if(operand <= UINT8_MAX){
+    emitBytes(op, operand);
+  } else {
+    emitByte(longOp);
+    emitByte((operand >> 16) & 0xff);
+    emitByte((operand >> 8) & 0xff);
+    emitByte(operand & 0xff);
+  }
+}
+
+static bool identifiersEqual(Token* a, Token* b){
+  return a->length == b->length &&
+         memcmp(a->start, b->start, a->length) == 0;
+}
+
+/*
+Locals live on the VM stack. A block's variables are pushed in the order
+they are declared and stay there until the block ends, so the index of
+a name in current->locals is also its stack slot. The innermost
+declaration wins, which is why the search runs backwards. Returns -1 for
+names that are not locals, those are globals.
+*/
+static int resolveLocal(Compiler* compiler, Token* name){
+  for(int i = compiler->localCount - 1; i >= 0; i--){
+    Local* local = &compiler->locals[i];
+    if(identifiersEqual(name, &local->name)){
+      if(local->depth == -1){
+        error("Can't read local variable in its own initializer.");
+      }
+      return i;
+    }
+  }
+  return -1;
 }
 
 static void namedVariable(Token name, bool canAssign){
-  uint8_t arg = identifierConstant(&name);
+  int local = resolveLocal(current, &name);
+  if(local != -1){
+    if(canAssign && match(TOKEN_EQUAL)){
+      expression();
+      emitBytes(OP_SET_LOCAL, (uint8_t)local);
+    } else{
+      emitBytes(OP_GET_LOCAL, (uint8_t)local);
+    }
+    return;
+  }
+
+  uint32_t arg = identifierSlot(&name);
   if(canAssign && match(TOKEN_EQUAL)){
     expression();
-    emitBytes(OP_SET_GLOBAL, arg);
+    emitWithOperand(OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, arg);
   } else{
-    emitBytes(OP_GET_GLOBAL, arg);
+    emitWithOperand(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, arg);
   }
 }
 
@@ -217,13 +616,67 @@ static void variable(bool canAssign){
   namedVariable(parser.previous, canAssign);
 }
 
+// The left operand decides. If it is false it is the result and the right
+// operand is skipped, otherwise it is popped and the right one is.
+static void and_(bool canAssign){
+  (void)canAssign;
+  int endJump = emitJump(OP_JUMP_IF_FALSE);
+  emitByte(OP_POP);
+  parsePrecedence(PREC_AND);
+  patchJump(endJump);
+}
+
+static void or_(bool canAssign){
+  (void)canAssign;
+  int elseJump = emitJump(OP_JUMP_IF_FALSE);
+  int endJump = emitJump(OP_JUMP);
+  patchJump(elseJump);
+  emitByte(OP_POP);
+  parsePrecedence(PREC_OR);
+  patchJump(endJump);
+}
+
+// The local is in scope but has no value yet until its initializer is
+// compiled, depth -1 marks that.
+static void addLocal(Token name){
+  if(current->localCount == UINT8_COUNT){
+    error("Too many local variables in scope.");
+    return;
+  }
+  Local* local = &current->locals[current->localCount++];
+  local->name = name;
+  local->depth = -1;
+}
+
+static void declareVariable(){
+  Token* name = &parser.previous;
+  for(int i = current->localCount - 1; i >= 0; i--){
+    Local* local = &current->locals[i];
+    if(local->depth != -1 && local->depth < current->scopeDepth) break;
+    if(identifiersEqual(name, &local->name)){
+      error("Already a variable with this name in this scope.");
+    }
+  }
+  addLocal(*name);
+}
+
 static uint32_t parseVariable(const char* message) {
   consume(TOKEN_IDENTIFIER, message); 
-  return identifierConstant(&parser.previous);
+  if(current->scopeDepth > 0){
+    declareVariable();
+    return 0;
+  }
+  return identifierSlot(&parser.previous);
 }
 
+// A local's value is already in its slot once the initializer ran, there
+// is nothing to emit.
 static void defineVariable(uint32_t global){
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  if(current->scopeDepth > 0){
+    current->locals[current->localCount - 1].depth = current->scopeDepth;
+    return;
+  }
+  emitWithOperand(OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
 static void varDeclaration() {
@@ -254,6 +707,7 @@ bool compile(const char* source, Chunk* chunk){
   Compiler compiler;
   initCompiler(&compiler);
   compilingChunk = chunk;
+  initConstantIndex();
   parser.hadError  = false;
   parser.panicMode = false;
   advance();
@@ -261,6 +715,13 @@ bool compile(const char* source, Chunk* chunk){
     declaration();
   }
   endCompiler();
+  freeConstantIndex();
+  // The chunk is still a collector root while the peephole pass runs.
+  if(!parser.hadError){
+    optimizeChunk(chunk);
+    chunk->maxStack = maxStackDepth(chunk);
+  }
+  compilingChunk = NULL;
   return !parser.hadError;
 }
 
@@ -275,7 +736,7 @@ void static advance(){
 }
 
 static void handle_string(bool canAssign){
-  copyString(parser.previous.start + 1, parser.previous.length -2);
+  (void)canAssign;
   emitConstant(
       OBJ_VAL(
         // trim start and end quotation marks
@@ -337,6 +798,7 @@ void emitReturn(){
 }
 
 static void literal(bool canAssign) {
+  (void)canAssign;
   TokenType type = parser.previous.type;
   switch(type){
     case TOKEN_FALSE: emitByte(OP_FALSE); break;
@@ -347,44 +809,357 @@ static void literal(bool canAssign) {
 }
 
 static void number(bool canAssign){
+  (void)canAssign;
   double value = strtod(parser.previous.start, NULL);
   emitConstant(NUMBER_VAL(value));
 }
 
+static void initConstantIndex(){
+  constantIndex.slots = NULL;
+  constantIndex.capacity = 0;
+  constantIndex.count = 0;
+}
+
+static void freeConstantIndex(){
+  free(constantIndex.slots);
+  initConstantIndex();
+}
+
+// Numbers are compared bit for bit so that 0 and -0 stay distinct and a
+// NaN literal still finds itself. Strings are interned, so the pointer
+// identifies them.
+static bool sameConstant(Value a, Value b){
+  if(IS_NUMBER(a) && IS_NUMBER(b)){
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b);
+}
+
+static uint32_t hashConstant(Value value){
+  uint64_t bits;
+  if(IS_NUMBER(value)){
+    double number = AS_NUMBER(value);
+    memcpy(&bits, &number, sizeof(bits));
+  } else {
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  }
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
+}
+
+static int* findConstantSlot(int* slots, int capacity, Value value){
+  ValueArray* constants = &currentChunk()->constants;
+  uint32_t index = hashConstant(value) & (capacity - 1);
+  for(;;){
+    int* slot = &slots[index];
+    if(*slot == -1) return slot;
+    if(*slot < constants->count &&
+       sameConstant(constants->values[*slot], value)){
+      return slot;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growConstantIndex(){
+  int capacity = constantIndex.capacity < 64 ? 64 : constantIndex.capacity * 2;
+  int* slots = malloc(sizeof(int) * capacity);
+  for(int i = 0; i < capacity; i++) slots[i] = -1;
+
+  ValueArray* constants = &currentChunk()->constants;
+  constantIndex.count = 0;
+  for(int i = 0; i < constantIndex.capacity; i++){
+    int index = constantIndex.slots[i];
+    if(index == -1 || index >= constants->count) continue;
+    *findConstantSlot(slots, capacity, constants->values[index]) = index;
+    constantIndex.count++;
+  }
+  free(constantIndex.slots);
+  constantIndex.slots = slots;
+  constantIndex.capacity = capacity;
+}
+
+// Returns the pool index of value, adding it only if it isn't there yet.
+static uint32_t makeConstant(Value value){
+  if(constantIndex.count + 1 > constantIndex.capacity / 2){
+    growConstantIndex();
+  }
+  int* slot = findConstantSlot(constantIndex.slots, constantIndex.capacity,
+                               value);
+  if(*slot != -1) return *slot;
+
+  int index = addConstant(currentChunk(), value);
+  if(index > UINT24_MAX){
+    error("Too many constants in one chunk.");
+    return 0;
+  }
+  *slot = index;
+  constantIndex.count++;
+  return index;
+}
+
 void emitConstant(Value value){
-  int index = addConstant(
-      currentChunk(),
-      value
-  );
-  emitBytes(OP_CONSTANT, (uint8_t)index);
+  emitWithOperand(OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(value));
+}
+
+/*
+Constant folding. Every operand starts at a known instruction boundary, so
+once an operator has parsed its operands we can look back at the bytes
+they produced. When each operand is a single constant load the operator
+is evaluated here and the whole expression is replaced by one constant.
+Anything that would be a runtime error (like "a" - 1) is left alone so
+the VM still reports it.
+*/
+
+// Reads the value loaded by the bytes in [start, end) if they are exactly
+// one constant-producing instruction.
+static bool constantOperand(int start, int end, Value* value){
+  Chunk* chunk = currentChunk();
+  if(end - start == 1){
+    switch(chunk->code[start]){
+      case OP_NIL: *value = NIL_VAL; return true;
+      case OP_TRUE: *value = BOOL_VAL(true); return true;
+      case OP_FALSE: *value = BOOL_VAL(false); return true;
+      default: return false;
+    }
+  }
+  if(end - start == 2 && chunk->code[start] == OP_CONSTANT){
+    *value = chunk->constants.values[chunk->code[start + 1]];
+    return true;
+  }
+  if(end - start == 4 && chunk->code[start] == OP_CONSTANT_LONG){
+    *value = chunk->constants.values[readUint24(&chunk->code[start + 1])];
+    return true;
+  }
+  return false;
+}
+
+static void truncateCode(int offset){
+  truncateChunk(currentChunk(), offset);
+  negatedComparison = -1;
+  addChain = -1;
+  comparison = -1;
+}
+
+// Removes everything from start on. Jumps inside the span are relative
+// and stay valid wherever it is pasted, as long as none of them leave it.
+static CodeSpan cutCode(int start){
+  Chunk* chunk = currentChunk();
+  CodeSpan span;
+  span.length = chunk->count - start;
+  span.code = malloc(span.length + 1);
+  span.lines = malloc(sizeof(int) * (span.length + 1));
+  if(span.code == NULL || span.lines == NULL) exit(1);
+  for(int i = 0; i < span.length; i++){
+    span.code[i] = chunk->code[start + i];
+    span.lines[i] = getLine(chunk, start + i);
+  }
+  truncateCode(start);
+  return span;
+}
+
+static void pasteCode(CodeSpan* span){
+  for(int i = 0; i < span->length; i++){
+    writeChunk(currentChunk(), span->code[i], span->lines[i]);
+  }
+  free(span->code);
+  free(span->lines);
+}
+
+// A folded operand's constant is often the last one in the pool. If the
+// folded expression is what added it, nothing else refers to it yet and
+// it can go. poolStart is the pool size when the expression began.
+static void dropOperand(int start, int poolStart){
+  Chunk* chunk = currentChunk();
+  int index;
+  switch(chunk->code[start]){
+    case OP_CONSTANT: index = chunk->code[start + 1]; break;
+    case OP_CONSTANT_LONG: index = readUint24(&chunk->code[start + 1]); break;
+    default: return;
+  }
+  if(index >= poolStart && index == chunk->constants.count - 1){
+    chunk->constants.count--;
+  }
+}
+
+static void emitValue(Value value){
+  if(IS_NIL(value)) emitByte(OP_NIL);
+  else if(IS_BOOL(value)) emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  else emitConstant(value);
+}
+
+static bool foldUnary(TokenType operator, Value operand, Value* result){
+  switch(operator){
+    case TOKEN_MINUS:
+      if(!IS_NUMBER(operand)) return false;
+      *result = NUMBER_VAL(-AS_NUMBER(operand));
+      return true;
+    case TOKEN_BANG:
+      *result = BOOL_VAL(isFalsey(operand));
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool foldBinary(TokenType operator, Value a, Value b, Value* result){
+  switch(operator){
+    case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+    case TOKEN_BANG_EQUAL: *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+    default: break;
+  }
+
+  if(operator == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)){
+    ObjString* left = AS_STRING(a);
+    ObjString* right = AS_STRING(b);
+    int length = left->length + right->length;
+    char* chars = malloc(length + 1);
+    memcpy(chars, left->chars, left->length);
+    memcpy(chars + left->length, right->chars, right->length);
+    chars[length] = '\0';
+    *result = OBJ_VAL(copyString(chars, length));
+    free(chars);
+    return true;
+  }
+
+  if(!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+
+  switch(operator){
+    case TOKEN_PLUS: *result = NUMBER_VAL(x + y); return true;
+    case TOKEN_MINUS: *result = NUMBER_VAL(x - y); return true;
+    case TOKEN_STAR: *result = NUMBER_VAL(x * y); return true;
+    case TOKEN_SLASH: *result = NUMBER_VAL(x / y); return true;
+    case TOKEN_GREATER: *result = BOOL_VAL(x > y); return true;
+    case TOKEN_LESS: *result = BOOL_VAL(x < y); return true;
+    // Mirror the OP_NOT forms the VM runs, which differ from >= and <=
+    // when an operand is NaN.
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+    case TOKEN_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+    default: return false;
+  }
 }
 
 static void unary(bool canAssign){
+  (void)canAssign;
   TokenType operatorType = parser.previous.type;
+  int start = currentChunk()->count;
+  int poolStart = currentChunk()->constants.count;
 
   parsePrecedence(PREC_UNARY); // parse unary or anything greater
 
+  Value operand, result;
+  if(lastTarget <= start &&
+     constantOperand(start, currentChunk()->count, &operand) &&
+     foldUnary(operatorType, operand, &result)){
+    dropOperand(start, poolStart);
+    truncateCode(start);
+    emitValue(result);
+    return;
+  }
+
   switch(operatorType){
     case TOKEN_MINUS: emitByte(OP_NEGATE); break;
-    case TOKEN_BANG: emitByte(OP_NOT); break;
+    case TOKEN_BANG: {
+      // !(a != b) is just a == b, the comparison already yields a bool.
+      if(negatedComparison == currentChunk()->count - 1 &&
+         negatedComparison > start &&
+         lastTarget != currentChunk()->count){
+        int cancelled = negatedComparison;
+        truncateCode(cancelled);
+        comparison = cancelled - 1;
+        break;
+      }
+      emitByte(OP_NOT);
+      break;
+    }
     default: return;
   }
 }
 
 static void grouping(bool canAssign){
+  (void)canAssign;
   // ( is already parsed
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
 }
 
+static void emitComparison(uint8_t opcode){
+  comparison = currentChunk()->count;
+  emitByte(opcode);
+}
+
+static void emitNegatedComparison(uint8_t comparison){
+  emitByte(comparison);
+  negatedComparison = currentChunk()->count;
+  emitByte(OP_NOT);
+}
+
+/*
+a + b + c parses as (a + b) + c, which would run one OP_ADD and build
+one throwaway string per +. When the left operand ends in the OP_ADD or
+OP_CONCAT_N of a chain, that instruction is taken out from between the
+operands and a single OP_CONCAT_N adds them all, so a chain of strings
+is copied once into a string of the final size.
+*/
+static void emitAdd(int rightStart){
+  Chunk* chunk = currentChunk();
+  int chain = addChain;
+  int count = 0;
+  if(lastTarget >= rightStart){
+    // A jump lands in the right operand or just after it, leave it be.
+  } else if(chain >= 0 && chain == rightStart - 1 &&
+            chunk->code[chain] == OP_ADD){
+    count = 3;
+  } else if(chain >= 0 && chain == rightStart - 2 &&
+            chunk->code[chain] == OP_CONCAT_N &&
+            chunk->code[chain + 1] < UINT8_MAX){
+    count = chunk->code[chain + 1] + 1;
+  }
+  if(count == 0){
+    addChain = chunk->count;
+    emitByte(OP_ADD);
+    return;
+  }
+
+  // Move the right operand down over the chain's instruction.
+  CodeSpan right = cutCode(rightStart);
+  truncateChunk(chunk, chain);
+  pasteCode(&right);
+
+  addChain = chunk->count;
+  emitBytes(OP_CONCAT_N, (uint8_t)count);
+}
+
 static void binary(bool canAssign){
+  (void)canAssign;
   TokenType operator = parser.previous.type;
+  int leftStart = exprStart;
+  int poolStart = exprPoolStart;
+  int rightStart = currentChunk()->count;
   ParseRule* rule = getRule(operator);
   parsePrecedence((Precedence)(rule->precedence+1)); // beyond the current prec
 
+  Value left, right, result;
+  if(lastTarget <= leftStart &&
+     constantOperand(leftStart, rightStart, &left) &&
+     constantOperand(rightStart, currentChunk()->count, &right) &&
+     foldBinary(operator, left, right, &result)){
+    dropOperand(rightStart, poolStart);
+    dropOperand(leftStart, poolStart);
+    truncateCode(leftStart);
+    emitValue(result);
+    return;
+  }
+
   switch(operator){
     case TOKEN_PLUS: {
-        emitByte(OP_ADD); break;
+        emitAdd(rightStart); break;
      }
     case TOKEN_MINUS: {
         emitByte(OP_SUBTRACT); break;
@@ -396,22 +1171,22 @@ static void binary(bool canAssign){
         emitByte(OP_DIVIDE); break;
      }
     case TOKEN_EQUAL_EQUAL: {
-        emitByte(OP_EQUAL); break;
+        emitComparison(OP_EQUAL); break;
     }
     case TOKEN_BANG_EQUAL: {
-        emitBytes(OP_EQUAL, OP_NOT); break;
+        emitNegatedComparison(OP_EQUAL); break;
     }
     case TOKEN_GREATER: {
-        emitByte(OP_GREATER); break;
+        emitComparison(OP_GREATER); break;
     }
     case TOKEN_GREATER_EQUAL: {
-        emitBytes(OP_LESS, OP_NOT); break;
+        emitNegatedComparison(OP_LESS); break;
     }
     case TOKEN_LESS_EQUAL: {
-        emitBytes(OP_GREATER, OP_NOT); break;
+        emitNegatedComparison(OP_GREATER); break;
     }
     case TOKEN_LESS: {
-        emitByte(OP_LESS); break;
+        emitComparison(OP_LESS); break;
     }
     default: return;
   }
@@ -430,12 +1205,16 @@ static void parsePrecedence(Precedence precedence){
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
+  int start = currentChunk()->count;
+  int poolStart = currentChunk()->constants.count;
 
   prefixFn(canAssign);
 
   while(precedence <= getRule(parser.current.type)->precedence) {
     advance();
     ParseFn infixFn = getRule(parser.previous.type)->infix;
+    exprStart = start;
+    exprPoolStart = poolStart;
     infixFn(canAssign);
   }
 
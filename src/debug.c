@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include "debug.h"
+#include "vm.h"
 
 void printObject(Value value){
   switch(OBJ_TYPE(value)){
@@ -7,17 +9,84 @@ void printObject(Value value){
         printf("%s", AS_CSTRING(value));
         break;
      }
+    case OBJ_ROPE: {
+        // Printing does not need the rope flattened, just its characters.
+        int length = AS_ROPE(value)->length;
+        char* chars = malloc(length);
+        if(chars == NULL) exit(1);
+        copyChars(AS_OBJ(value), chars);
+        fwrite(chars, 1, length, stdout);
+        free(chars);
+        break;
+     }
   }
 }
 
 void printValue(Value value){
-  ValueType type = value.type;
-  switch(type){
-      case VAL_BOOL: printf(AS_BOOL(value)? "true": "false"); break;
-      case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-      case VAL_NIL: printf("nil"); break;
-      case VAL_OBJ: printObject(value); break;
-  }
+  if(IS_BOOL(value)) printf(AS_BOOL(value)? "true": "false");
+  else if(IS_NUMBER(value)) printf("%g", AS_NUMBER(value));
+  else if(IS_NIL(value)) printf("nil");
+  else if(IS_OBJ(value)) printObject(value);
+}
+
+static const char* opcodeNames[] = {
+  [OP_CONSTANT]           = "OP_CONSTANT",
+  [OP_NEGATE]             = "OP_NEGATE",
+  [OP_ADD]                = "OP_ADD",
+  [OP_SUBTRACT]           = "OP_SUBTRACT",
+  [OP_MULTIPLY]           = "OP_MULTIPLY",
+  [OP_DIVIDE]             = "OP_DIVIDE",
+  [OP_NIL]                = "OP_NIL",
+  [OP_TRUE]               = "OP_TRUE",
+  [OP_FALSE]              = "OP_FALSE",
+  [OP_RETURN]             = "OP_RETURN",
+  [OP_NOT]                = "OP_NOT",
+  [OP_EQUAL]              = "OP_EQUAL",
+  [OP_GREATER]            = "OP_GREATER",
+  [OP_LESS]               = "OP_LESS",
+  [OP_PRINT]              = "OP_PRINT",
+  [OP_POP]                = "OP_POP",
+  [OP_DEFINE_GLOBAL]      = "OP_DEFINE_GLOBAL",
+  [OP_GET_GLOBAL]         = "OP_GET_GLOBAL",
+  [OP_SET_GLOBAL]         = "OP_SET_GLOBAL",
+  [OP_NOT_EQUAL]          = "OP_NOT_EQUAL",
+  [OP_DEFINE_GLOBAL_KEEP] = "OP_DEFINE_GLOBAL_KEEP",
+  [OP_SET_GLOBAL_POP]     = "OP_SET_GLOBAL_POP",
+  [OP_ADD_SET_GLOBAL_POP] = "OP_ADD_SET_GLOBAL_POP",
+  [OP_SUBTRACT_SET_GLOBAL_POP]  = "OP_SUBTRACT_SET_GLOBAL_POP",
+  [OP_GLOBAL_ADD_CONSTANT]      = "OP_GLOBAL_ADD_CONSTANT",
+  [OP_GLOBAL_SUBTRACT_CONSTANT] = "OP_GLOBAL_SUBTRACT_CONSTANT",
+  [OP_GLOBAL_MULTIPLY_CONSTANT] = "OP_GLOBAL_MULTIPLY_CONSTANT",
+  [OP_GLOBAL_DIVIDE_CONSTANT]   = "OP_GLOBAL_DIVIDE_CONSTANT",
+  [OP_CONSTANT_LONG]      = "OP_CONSTANT_LONG",
+  [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+  [OP_GET_GLOBAL_LONG]    = "OP_GET_GLOBAL_LONG",
+  [OP_SET_GLOBAL_LONG]    = "OP_SET_GLOBAL_LONG",
+  [OP_CONCAT_N]           = "OP_CONCAT_N",
+  [OP_GET_LOCAL]          = "OP_GET_LOCAL",
+  [OP_SET_LOCAL]          = "OP_SET_LOCAL",
+  [OP_POPN]               = "OP_POPN",
+  [OP_SET_LOCAL_POP]      = "OP_SET_LOCAL_POP",
+  [OP_JUMP]               = "OP_JUMP",
+  [OP_LOOP]               = "OP_LOOP",
+  [OP_JUMP_IF_FALSE]      = "OP_JUMP_IF_FALSE",
+  [OP_POP_JUMP_IF_FALSE]  = "OP_POP_JUMP_IF_FALSE",
+  [OP_JUMP_IF_LESS]       = "OP_JUMP_IF_LESS",
+  [OP_JUMP_IF_NOT_LESS]   = "OP_JUMP_IF_NOT_LESS",
+  [OP_JUMP_IF_GREATER]    = "OP_JUMP_IF_GREATER",
+  [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+  [OP_JUMP_IF_EQUAL]      = "OP_JUMP_IF_EQUAL",
+  [OP_JUMP_IF_NOT_EQUAL]  = "OP_JUMP_IF_NOT_EQUAL",
+  [OP_FOR_STEP]           = "OP_FOR_STEP",
+  [OP_ADD_NUM]            = "OP_ADD_NUM",
+  [OP_ADD_STR]            = "OP_ADD_STR",
+  [OP_EQUAL_NUM]          = "OP_EQUAL_NUM",
+  [OP_NOT_EQUAL_NUM]      = "OP_NOT_EQUAL_NUM",
+};
+
+const char* opcodeName(uint8_t opcode){
+  if(opcode >= OPCODE_COUNT) return NULL;
+  return opcodeNames[opcode];
 }
 
 static int simpleInstruction(const char* name, int offset){
@@ -34,6 +103,85 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset){
   return offset+2;
 }
 
+static int byteInstruction(const char* name, Chunk* chunk, int offset){
+  printf("%-16s %4d\n", name, chunk->code[offset+1]);
+  return offset+2;
+}
+
+static int jumpInstruction(const char* name, Chunk* chunk, int offset){
+  printf("%-16s %4d -> %d\n", name, offset, jumpTarget(chunk->code, offset));
+  return offset+3;
+}
+
+static int forStepInstruction(const char* name, Chunk* chunk, int offset){
+  static const char* compares[] = {"<", "<=", ">", ">="};
+  uint8_t* operands = &chunk->code[offset + 1];
+  printf("%-16s %4d += '", name, operands[0]);
+  printValue(chunk->constants.values[operands[1]]);
+  printf("' %s ", compares[operands[3] & FOR_STEP_COMPARE]);
+  if(operands[3] & FOR_STEP_CONSTANT_BOUND){
+    printf("'");
+    printValue(chunk->constants.values[operands[2]]);
+    printf("'");
+  } else {
+    printf("%d", operands[2]);
+  }
+  printf(" -> %d\n", jumpTarget(chunk->code, offset));
+  return offset+7;
+}
+
+// A quickenable instruction, followed by the kinds of operands it ran
+// with so far. One kind means the site is monomorphic.
+static int feedbackInstruction(const char* name, Chunk* chunk, int offset){
+  uint8_t seen = chunk->feedback != NULL
+                   ? chunk->feedback[offset] & FEEDBACK_KINDS : 0;
+  if(seen == 0) return simpleInstruction(name, offset);
+  printf("%-16s     [", name);
+  const char* separator = "";
+  if(seen & FEEDBACK_NUMBER){ printf("number"); separator = " "; }
+  if(seen & FEEDBACK_STRING){ printf("%sstring", separator); separator = " "; }
+  if(seen & FEEDBACK_OTHER) printf("%sother", separator);
+  printf("]\n");
+  return offset+1;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk, int offset){
+  uint8_t slot = chunk->code[offset+1];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset+2;
+}
+
+static int constantLongInstruction(const char* name, Chunk* chunk,
+                                   int offset){
+  int constant = readUint24(&chunk->code[offset+1]);
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset+4;
+}
+
+static int globalLongInstruction(const char* name, Chunk* chunk, int offset){
+  int slot = readUint24(&chunk->code[offset+1]);
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset+4;
+}
+
+static int globalConstantInstruction(const char* name, Chunk* chunk,
+                                     int offset){
+  uint8_t slot = chunk->code[offset+1];
+  uint8_t constant = chunk->code[offset+2];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("' %4d '", constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset+3;
+}
+
 void disassembleChunk(Chunk* chunk, const char* name){
   printf("== %s ==\n", name);
 
@@ -45,55 +193,60 @@ void disassembleChunk(Chunk* chunk, const char* name){
 
 int disassembleInstruction(Chunk* chunk, int offset){
   printf("off: %04d ", offset);
-  if (offset > 0 &&
-      chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4d ", chunk->lines[offset]);
+    printf("%4d ", line);
   }
   uint8_t instruction = chunk->code[offset];
+  const char* name = opcodeName(instruction);
   switch(instruction){
-    case OP_RETURN:
-      return simpleInstruction("OP_RETURN", offset);
-    case OP_NEGATE:
-      return simpleInstruction("OP_NEGATE", offset);
-    case OP_ADD:
-      return simpleInstruction("OP_ADD", offset);
-    case OP_SUBTRACT:
-      return simpleInstruction("OP_SUBTRACT", offset);
-    case OP_MULTIPLY:
-      return simpleInstruction("OP_MULTIPLY", offset);
-    case OP_DIVIDE:
-      return simpleInstruction("OP_DIVIDE", offset);
-    case OP_FALSE:
-      return simpleInstruction("OP_FALSE", offset);
-    case OP_TRUE:
-      return simpleInstruction("OP_TRUE", offset);
-    case OP_NIL:
-      return simpleInstruction("OP_NIL", offset);
-    case OP_NOT:
-      return simpleInstruction("OP_NOT", offset);
-    case OP_LESS:
-      return simpleInstruction("OP_LESS", offset);
-    case OP_GREATER:
-      return simpleInstruction("OP_GREATER", offset);
-    case OP_EQUAL:
-      return simpleInstruction("OP_EQUAL", offset);
     case OP_CONSTANT:
-      return constantInstruction("OP_CONSTANT", chunk, offset);
-    case OP_PRINT:
-      return simpleInstruction("OP_PRINT", offset);
-    case OP_POP:
-      return simpleInstruction("OP_POP", offset);
+      return constantInstruction(name, chunk, offset);
     case OP_DEFINE_GLOBAL:
-      return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_KEEP:
     case OP_GET_GLOBAL:
-      return constantInstruction("OP_GET_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-      return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL_POP:
+    case OP_ADD_SET_GLOBAL_POP:
+    case OP_SUBTRACT_SET_GLOBAL_POP:
+      return globalInstruction(name, chunk, offset);
+    case OP_GLOBAL_ADD_CONSTANT:
+    case OP_GLOBAL_SUBTRACT_CONSTANT:
+    case OP_GLOBAL_MULTIPLY_CONSTANT:
+    case OP_GLOBAL_DIVIDE_CONSTANT:
+      return globalConstantInstruction(name, chunk, offset);
+    case OP_CONSTANT_LONG:
+      return constantLongInstruction(name, chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+      return globalLongInstruction(name, chunk, offset);
+    case OP_CONCAT_N:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_POPN:
+    case OP_SET_LOCAL_POP:
+      return byteInstruction(name, chunk, offset);
+    case OP_FOR_STEP:
+      return forStepInstruction(name, chunk, offset);
+    case OP_ADD:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_EQUAL_NUM:
+    case OP_NOT_EQUAL_NUM:
+      return feedbackInstruction(name, chunk, offset);
     default:
+      if(isJump(instruction)){
+        return jumpInstruction(name, chunk, offset);
+      }
+      if(name == NULL){
         printf("Unknown Opcode %d\n", instruction);
         return offset+1;
+      }
+      return simpleInstruction(name, offset);
   }
 }
-
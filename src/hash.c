@@ -0,0 +1,105 @@
+#include <string.h>
+#include "hash.h"
+
+/*
+Word at a time string hash, the round and lane layout follow xxHash64.
+
+FNV-1a did one multiply per byte, each depending on the one before. Here
+a multiply takes in eight bytes. Strings of 32 bytes or more are split
+over four lanes whose multiplies don't depend on each other, so they
+overlap in the pipeline. Identifiers are nearly all shorter than that
+and only take the single lane loop. The closing avalanche (fmix64 from
+MurmurHash3) spreads every input bit over the low bits the tables take
+their index from.
+
+Words are read in host byte order. The only hash that outlives the
+process is the one in the compile cache's entry names, and a cache shared
+between hosts of different byte order just misses.
+*/
+
+#define PRIME1 0x9e3779b185ebca87u
+#define PRIME2 0xc2b2ae3d27d4eb4fu
+#define PRIME3 0x165667b19e3779f9u
+#define PRIME4 0x85ebca77c2b2ae63u
+
+static inline uint64_t rotate(uint64_t x, int bits){
+  return (x << bits) | (x >> (64 - bits));
+}
+
+static inline uint64_t readWord(const char* p){
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+static inline uint32_t readHalf(const char* p){
+  uint32_t half;
+  memcpy(&half, p, sizeof(half));
+  return half;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t word){
+  acc += word * PRIME2;
+  acc = rotate(acc, 31);
+  return acc * PRIME1;
+}
+
+static inline uint64_t mergeLane(uint64_t hash, uint64_t lane){
+  hash ^= round64(0, lane);
+  return hash * PRIME1 + PRIME4;
+}
+
+uint64_t hashBytes(const char* key, size_t length){
+  const char* p = key;
+  const char* end = key + length;
+  uint64_t hash;
+
+  if(length >= 32){
+    uint64_t v1 = PRIME1 + PRIME2;
+    uint64_t v2 = PRIME2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - PRIME1;
+    do {
+      v1 = round64(v1, readWord(p));
+      v2 = round64(v2, readWord(p + 8));
+      v3 = round64(v3, readWord(p + 16));
+      v4 = round64(v4, readWord(p + 24));
+      p += 32;
+    } while(end - p >= 32);
+    hash = rotate(v1, 1) + rotate(v2, 7) + rotate(v3, 12) + rotate(v4, 18);
+    hash = mergeLane(hash, v1);
+    hash = mergeLane(hash, v2);
+    hash = mergeLane(hash, v3);
+    hash = mergeLane(hash, v4);
+  } else {
+    hash = PRIME3;
+  }
+  hash += length;
+
+  for(; end - p >= 8; p += 8){
+    hash ^= round64(0, readWord(p));
+    hash = rotate(hash, 27) * PRIME1 + PRIME4;
+  }
+  size_t rest = end - p;
+  if(rest > 0){
+    // The last one to seven bytes, without a loop. Reads may overlap, the
+    // length is already in the hash so that can't cause collisions.
+    uint64_t word;
+    if(rest >= 4){
+      word = (uint64_t)readHalf(p) << 32 | readHalf(end - 4);
+    } else {
+      word = (uint64_t)(uint8_t)p[0] << 16 |
+             (uint64_t)(uint8_t)p[rest >> 1] << 8 |
+             (uint8_t)p[rest - 1];
+    }
+    hash ^= word * PRIME3;
+    hash = rotate(hash, 23) * PRIME2 + PRIME4;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdu;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53u;
+  hash ^= hash >> 33;
+  return hash;
+}
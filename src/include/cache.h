@@ -0,0 +1,11 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "chunk.h"
+#include "serialize.h"
+
+bool loadCachedChunk(const char* source, Chunk* chunk, Mapping* mapping);
+void storeCachedChunk(const char* source, Chunk* chunk);
+void printCacheStats();
+
+#endif
@@ -24,20 +24,121 @@ typedef enum {
   OP_POP,
   OP_DEFINE_GLOBAL,
   OP_GET_GLOBAL,
-  OP_SET_GLOBAL
+  OP_SET_GLOBAL,
+  OP_NOT_EQUAL,
+  OP_DEFINE_GLOBAL_KEEP,
+  // Superinstructions, only produced by the peephole pass.
+  OP_SET_GLOBAL_POP,
+  OP_ADD_SET_GLOBAL_POP,
+  OP_SUBTRACT_SET_GLOBAL_POP,
+  OP_GLOBAL_ADD_CONSTANT,
+  OP_GLOBAL_SUBTRACT_CONSTANT,
+  OP_GLOBAL_MULTIPLY_CONSTANT,
+  OP_GLOBAL_DIVIDE_CONSTANT,
+  // 24 bit operand forms, for chunks with more than 256 constants or
+  // programs with more than 256 globals.
+  OP_CONSTANT_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  // Adds the top n values left to right, a chain of + in one dispatch.
+  OP_CONCAT_N,
+  // Block scoped variables, addressed by stack slot.
+  OP_GET_LOCAL,
+  OP_SET_LOCAL,
+  // Pops n values, the locals of a scope that ends.
+  OP_POPN,
+  // OP_SET_LOCAL; OP_POP, from the peephole pass.
+  OP_SET_LOCAL_POP,
+  // Control flow. Every jump has a 16 bit offset relative to the end of
+  // the instruction, OP_LOOP jumps backwards by it, all others forwards.
+  OP_JUMP,
+  OP_LOOP,
+  OP_JUMP_IF_FALSE,     // leaves the condition, for `and` and `or`
+  OP_POP_JUMP_IF_FALSE, // pops it, for statements
+  // A comparison fused with the branch on its result. Both operands are
+  // popped and no bool is made.
+  OP_JUMP_IF_LESS,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_GREATER,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_EQUAL,
+  OP_JUMP_IF_NOT_EQUAL,
+  // The end of a counted for loop: steps a local by a number, compares
+  // it to the bound and jumps back to the body, see forStatement().
+  // Operands: counter slot, step constant, bound, mode, 16 bit offset.
+  OP_FOR_STEP,
+  // Quickened forms, written over OP_ADD, OP_EQUAL and OP_NOT_EQUAL by
+  // the VM while a site has only seen one kind of operand, see quicken().
+  // The compiler never emits them.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_EQUAL_NUM,
+  OP_NOT_EQUAL_NUM,
+
+  OPCODE_COUNT
 } Opcode;
 
+#define UINT24_MAX 0xffffff
+
+// OP_FOR_STEP's mode byte. The low bits say how the counter is compared
+// to the bound, FOR_STEP_CONSTANT_BOUND that the bound operand is a
+// constant index rather than a local slot.
+#define FOR_STEP_LESS 0
+#define FOR_STEP_LESS_EQUAL 1
+#define FOR_STEP_GREATER 2
+#define FOR_STEP_GREATER_EQUAL 3
+#define FOR_STEP_COMPARE 3
+#define FOR_STEP_CONSTANT_BOUND 4
+
+// Kinds of operands a quickenable instruction has run with, or-ed into
+// its byte of Chunk.feedback. FEEDBACK_WARM is set once it ran at all.
+#define FEEDBACK_NUMBER 1
+#define FEEDBACK_STRING 2
+#define FEEDBACK_OTHER 4
+#define FEEDBACK_KINDS 7
+#define FEEDBACK_WARM 8
+
+// Line numbers are run-length encoded. Each LineStart covers the bytes
+// from its offset up to the next one's, so a statement that compiles to
+// a dozen bytes costs one entry instead of a dozen ints.
+typedef struct {
+  int offset;
+  int line;
+} LineStart;
+
 typedef struct{
   int count;
   int capacity;
   uint8_t* code; // list of codes, Arr of bytes
   ValueArray constants;
-  int* lines;
+  int lineCount;
+  int lineCapacity;
+  LineStart* lines;
+  uint8_t* feedback; // one byte per code byte, see quicken() in vm.c
+  int maxStack;      // most values the code keeps on the stack at once
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
+void truncateChunk(Chunk* chunk, int count);
+int getLine(Chunk* chunk, int offset);
 int addConstant(Chunk* chunk, Value value);
+int opcodeLength(uint8_t opcode);
+void stackEffect(const uint8_t* code, int* pops, int* pushes);
+bool isJump(uint8_t opcode);
+int jumpTarget(const uint8_t* code, int offset);
+void setJumpTarget(uint8_t* code, int offset, int target);
+int maxStackDepth(Chunk* chunk);
+
+// Long operands are stored big endian, most significant byte first.
+static inline int readUint24(const uint8_t* bytes){
+  return (bytes[0] << 16) | (bytes[1] << 8) | bytes[2];
+}
+
+static inline int readUint16(const uint8_t* bytes){
+  return (bytes[0] << 8) | bytes[1];
+}
 
 #endif
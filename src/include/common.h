@@ -5,10 +5,49 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+/*#define NAN_BOXING // Pack every Value into a single 64 bit word*/
+
 /*#define DEBUG_TRACE_EXECUTION // Passes into chunk and into VM*/
 /*#define DEBUG_PRINT_CODE*/
+/*#define DEBUG_STATS // Instruction count and run time per interpret()*/
+/*#define DEBUG_STRESS_GC // Collect on every allocation, flushes out missing roots*/
+/*#define DEBUG_LOG_GC*/
 
 // Use compiler flags instead
 /*-DDEBUG_IMPLEMENTATION=1*/
 
+#ifdef DEBUG_IMPLEMENTATION
+#define DEBUG_PRINT_CODE
+#endif
+
+// SSE2 fast paths in the table and the scanner. Build with -DNO_SIMD to
+// get the portable loops instead.
+#if defined(__SSE2__) && !defined(NO_SIMD)
+#define USE_SSE2
+#endif
+
+// Index of the lowest set bit, mask must not be 0.
+static inline int lowestBit(uint32_t mask){
+#ifdef __GNUC__
+  return __builtin_ctz(mask);
+#else
+  int bit = 0;
+  while(!(mask & 1)){
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+#endif
+}
+
+static inline int countBits(uint32_t mask){
+#ifdef __GNUC__
+  return __builtin_popcount(mask);
+#else
+  int count = 0;
+  for(; mask != 0; mask &= mask - 1) count++;
+  return count;
+#endif
+}
+
 #endif
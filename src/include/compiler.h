@@ -6,6 +6,7 @@
 #include "object.h"
 
 bool compile(const char* source, Chunk* chunk);
+void markCompilerRoots();
 
 static void statement();
 static void declaration();
@@ -8,5 +8,6 @@
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 void printValue(Value value);
+const char* opcodeName(uint8_t opcode);
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+uint64_t hashBytes(const char* key, size_t length);
+
+// The 32 bit hash kept in every ObjString.
+static inline uint32_t hashString(const char* key, int length){
+  uint64_t hash = hashBytes(key, (size_t)length);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+#endif
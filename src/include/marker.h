@@ -0,0 +1,17 @@
+#ifndef clox_marker_h
+#define clox_marker_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+bool markerActive();
+void startMarking();
+void pollMarker();
+void finishMarker();
+void storeGlobalWhileMarking(Value* global, Value value);
+void storeFlatWhileMarking(ObjRope* rope, ObjString* flat);
+ObjString* loadFlat(ObjRope* rope);
+void freeMarker();
+
+#endif
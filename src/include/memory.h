@@ -3,8 +3,18 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 
+// Heap size at which the first collection runs. After that the
+// threshold follows the live heap, see collectGarbage().
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+
+// Young objects are bump allocated here. Anything bigger than
+// NURSERY_MAX_OBJECT goes straight to the old heap.
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 16)
+
 #define GROW_CAPACITY(capacity)\
   ((capacity) < 8 ? 8: (capacity) * 2)
 
@@ -19,18 +29,46 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+typedef enum {
+  PAUSE_MINOR,
+  PAUSE_INITIAL_MARK,
+  PAUSE_REMARK,
+  PAUSE_FULL,
+  PAUSE_KIND_COUNT
+} PauseKind;
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateYoung(size_t size);
+void rememberGlobal(int slot);
+void markObject(Obj* object);
+void markValue(Value value);
+void markArray(ValueArray* array);
+void traceReferences();
+size_t releaseObject(Obj* object);
+void setNextGC();
+void collectYoung();
+void collectGarbage();
+void initHeap();
+void freeObjects();
+double gcClock();
+void recordPause(PauseKind kind, double start);
+void printGCStats();
+
+static inline bool isYoung(Obj* object){
+  return (uint8_t*)object >= vm.nursery && (uint8_t*)object < vm.nurseryEnd;
+}
 
 static void freeObject(Obj* object) {
   switch (object->type) {
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(ObjString, object);
+      reallocate(object, STRING_SIZE(string->length), 0);
       break;
     }
+    case OBJ_ROPE:
+      FREE(ObjRope, object);
+      break;
   }
 }
-void freeObjects();
 
 #endif
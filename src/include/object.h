@@ -3,17 +3,20 @@
 #define clox_object_h
 
 #include <stdbool.h>
+#include <string.h>
 #include "common.h"
 #include "value.h"
 
 #define OBJ_TYPE(obj) (AS_OBJ(obj)->type)
 
 typedef enum{
-  OBJ_STRING
+  OBJ_STRING,
+  OBJ_ROPE
 } ObjType;
 
 struct Obj {
   ObjType type;
+  bool isMarked;
   struct Obj* next;
 };
 
@@ -29,8 +32,8 @@ Object:
 [000000]
 
 ObjectString:
---Obj--  -length-   --chars--
-[000000][00000000][00000000000]
+--Obj--  -length-  -hash-  --chars--
+[000000][00000000][000000][00000000000]
 
 Note how the first bytes of ObjString exactly line up with Obj. 
 This is not a coincidence—C mandates it. This is designed to enable a clever pattern: 
@@ -44,19 +47,59 @@ work with all objects can treat them as base Obj* and ignore any other fields th
 may happen to follow.
 */
 
+// The characters live right after the header, in the same allocation.
 struct ObjString {
   Obj obj;
   int length;
-  char* chars;
   uint32_t hash;
+  char chars[];
 };
 
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+/*
+The lazy result of a concatenation, see concatenate(). Both children are
+an ObjString or another ObjRope. The characters are only put together
+when something needs them in one piece: the flat copy is then kept in
+flat and the children are let go.
+*/
+typedef struct {
+  Obj obj;
+  int length;
+  Obj* left;
+  Obj* right;
+  ObjString* flat;   // interned and never young, NULL until flattened
+} ObjRope;
+
+// Concatenations shorter than this are copied right away, a rope node
+// costs more than copying the characters would.
+#define ROPE_MIN_LENGTH 256
+
 #define IS_STRING(value) (isObjType(value, OBJ_STRING))
+#define IS_ROPE(value) (isObjType(value, OBJ_ROPE))
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
+static inline bool stringsEqual(ObjString* a, ObjString* b){
+  return a == b ||
+         (a->length == b->length && a->hash == b->hash &&
+          memcmp(a->chars, b->chars, a->length) == 0);
+}
+
 ObjString* copyString(const char* chars, int length);
-ObjString* takeString(char* chars, int length);
+ObjString* newString(int length);
+void finishString(ObjString* string);
+ObjRope* newRope();
+ObjString* flattenRope(Value* rope);
+void copyChars(Obj* string, char* dest);
+
+// Length of an ObjString or an ObjRope.
+static inline int stringLength(Obj* string){
+  return string->type == OBJ_STRING ? ((ObjString*)string)->length
+                                    : ((ObjRope*)string)->length;
+}
 
 static inline bool isObjType(Value value, ObjType type){
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
@@ -0,0 +1,24 @@
+#ifndef clox_serialize_h
+#define clox_serialize_h
+
+#include "common.h"
+#include "chunk.h"
+
+// Bump whenever the opcode set or the file layout changes, old files are
+// rejected instead of misread.
+#define BYTECODE_VERSION 6
+
+// A .cloxc file mapped into memory. The loaded chunk's code and line
+// table point straight into it, so it has to outlive the chunk.
+typedef struct {
+  void* data;
+  size_t size;
+} Mapping;
+
+bool writeBytecode(Chunk* chunk, const char* path);
+bool loadBytecode(const char* path, Chunk* chunk, Mapping* mapping);
+bool tryLoadBytecode(const char* path, Chunk* chunk, Mapping* mapping);
+void unloadBytecode(Chunk* chunk, Mapping* mapping);
+void markBytecodeRoots();
+
+#endif
@@ -9,10 +9,13 @@ typedef struct {
   Value value;
 } Entry;
 
+// See table.c for the layout.
 typedef struct {
   int count;
-  int capacity;
+  int deleted;       // slots marked DELETED, purged on the next resize
+  int capacity;      // 0 or a power of two, at least 16
   Entry* entries;
+  uint8_t* control;  // one byte per entry, in the same block
 } Table;
 
 void initTable(Table* table);
@@ -23,5 +26,7 @@ bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash);
+void tableRemoveWhite(Table* table);
+void markTable(Table* table);
 
 #endif
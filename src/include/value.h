@@ -1,14 +1,86 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <string.h>
+#include "common.h"
+
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+// UNDEFINED_VAL marks a global slot that was declared by the compiler
+// but never defined at runtime. It is never pushed on the stack.
+
+#ifdef NAN_BOXING
+
+/*
+A double whose exponent bits are all set and whose quiet bit is set is a
+quiet NaN, and the hardware only ever produces one particular quiet NaN.
+That leaves the remaining 51 mantissa bits free for us:
+
+    sign  exponent (11)   quiet  payload (50 bits)
+    [ 0 ][ 11111111111 ][ 1 1 ][ ... tag in the low bits ... ]  singletons
+    [ 1 ][ 11111111111 ][ 1 1 ][ ... 48 bit Obj* ...        ]  objects
+
+Anything that is not a quiet NaN is a plain double. nil, true and false
+are quiet NaNs tagged in the low bits, and objects set the sign bit
+and keep the pointer in the low 48 bits, which is all x86-64 and AArch64
+use for user space addresses.
+*/
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL       1 // 001.
+#define TAG_FALSE     2 // 010.
+#define TAG_TRUE      3 // 011.
+#define TAG_UNDEFINED 4 // 100.
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL  ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_VAL(num) numToValue(num)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define OBJ_VAL(obj) \
+  (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) \
+  ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_OBJ(value) \
+  (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+// memcpy is the portable way to reinterpret the bits, compilers turn
+// it into a plain register move.
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NUMBER,
   VAL_NIL,
-  VAL_OBJ
+  VAL_OBJ,
+  VAL_UNDEFINED
 } ValueType;
 
 typedef struct {
@@ -23,6 +95,7 @@ typedef struct {
 #define BOOL_VAL(value) ((Value){VAL_BOOL, .as={.boolean=value}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, .as={.number=value}})
 #define NIL_VAL ((Value){VAL_NIL, .as={.number=0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, .as={.number=0}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, .as={.obj=(Obj*)object}})
 
 #define AS_BOOL(value) ((value).as.boolean)
@@ -32,8 +105,11 @@ typedef struct {
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
+#endif
+
 typedef struct{
   int capacity;
   int count;
@@ -43,6 +119,7 @@ typedef struct{
 void initValueArray(ValueArray* valueArray);
 void writeValueArray(ValueArray* valueArray, Value value);
 void freeValueArray(ValueArray* valueArray);
+bool valuesEqual(Value a, Value b);
 
 #endif
 
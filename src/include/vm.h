@@ -6,16 +6,40 @@
 #include "value.h"
 #include "table.h"
 
-#define STACK_MAX 256
+// The stack starts this big and grows on entry to a chunk that needs
+// more, see interpretChunk(). Pushes are never checked.
+#define STACK_INITIAL 256
+
+// Slots the handlers use above what the compiled code keeps there:
+// OP_CONCAT_N's fallback pushes two operands and concatenate() roots a
+// third value while it allocates.
+#define STACK_HEADROOM 3
 
 typedef struct {
   Chunk* chunk;
   uint8_t* ip;
-  Value stack[STACK_MAX];
+  Value* stack;
   Value* stackTop; // points to where the next item will go
+  int stackCapacity;
   Obj* objects;
   Table strings;
-  Table globals;
+  Table globalSlots;       // name -> slot, resolved by the compiler
+  ValueArray globalNames;  // slot -> name, for error messages
+  ValueArray globalValues; // slot -> value, UNDEFINED_VAL until defined
+  size_t bytesAllocated;
+  size_t nextGC;           // collect once bytesAllocated goes past this
+  int grayCount;
+  int grayCapacity;
+  Obj** grayStack;         // marked objects whose references are unvisited
+  bool marking;            // a concurrent mark is running, see marker.c
+  uint8_t* nursery;        // young objects, bump allocated
+  uint8_t* nurseryTop;
+  uint8_t* nurseryEnd;
+  int* rememberedGlobals;  // slots that may hold a young object
+  int rememberedCount;
+  int rememberedCapacity;
+  bool* isRemembered;      // per slot, keeps rememberedGlobals unique
+  int isRememberedCapacity;
 }VM;
 
 typedef enum {
@@ -32,8 +56,12 @@ Value pop();
 void initVM();
 void freeVM();
 
+bool compileSource(const char* source, Chunk* chunk);
 InterpretResult interpret(const char* source);
+InterpretResult interpretChunk(Chunk* chunk);
+int globalSlot(ObjString* name);
 
 void concatenate();
+bool isFalsey(Value value);
 
 #endif
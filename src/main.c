@@ -1,8 +1,12 @@
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
+#include "serialize.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 #include "vm.h"
 
 static char* readFile(const char* path){
@@ -38,15 +42,81 @@ static void repl(){
   }
 }
 
+// Set by --gc-stats, prints the collector's pause histogram after the
+// script ran.
+static bool showGCStats = false;
+
+static bool hasExtension(const char* path, const char* extension){
+  size_t pathLength = strlen(path);
+  size_t extensionLength = strlen(extension);
+  return pathLength >= extensionLength &&
+         strcmp(path + pathLength - extensionLength, extension) == 0;
+}
+
+// Precompiled .cloxc files skip the scanner and compiler entirely.
+static InterpretResult runBytecode(const char* path){
+  Chunk chunk;
+  Mapping mapping;
+  if(!loadBytecode(path, &chunk, &mapping)) exit(65);
+
+  InterpretResult result = interpretChunk(&chunk);
+  unloadBytecode(&chunk, &mapping);
+  return result;
+}
+
+// Source files go through the bytecode cache. Debug builds skip it so
+// the compiler's disassembly is printed on every run.
+static InterpretResult runSource(const char* source){
+#ifdef DEBUG_PRINT_CODE
+  return interpret(source);
+#else
+  Chunk chunk;
+  Mapping mapping;
+  InterpretResult result;
+  if(loadCachedChunk(source, &chunk, &mapping)){
+    result = interpretChunk(&chunk);
+    unloadBytecode(&chunk, &mapping);
+    return result;
+  }
+
+  if(!compileSource(source, &chunk)) return INTERPRET_COMPILE_ERROR;
+  storeCachedChunk(source, &chunk);
+  result = interpretChunk(&chunk);
+  freeChunk(&chunk);
+  return result;
+#endif
+}
+
 static void runFile(const char* path){
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+    InterpretResult result;
+    if(hasExtension(path, ".cloxc")){
+      result = runBytecode(path);
+    } else {
+      char* source = readFile(path);
+      result = runSource(source);
+      free(source);
+    }
 
+    if(showGCStats) printGCStats();
     if(result == INTERPRET_COMPILE_ERROR) exit(65);
     if(result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void compileFile(const char* path, const char* outPath){
+  char* source = readFile(path);
+  Chunk chunk;
+  bool compiled = compileSource(source, &chunk);
+  free(source);
+  if(!compiled) exit(65);
+
+  bool written = writeBytecode(&chunk, outPath);
+  freeChunk(&chunk);
+  if(!written){
+    fprintf(stderr, "Could not write file \"%s\".\n", outPath);
+    exit(74);
+  }
+}
+
 int main(int argc, char** argv){
   initVM();
 
@@ -54,12 +124,28 @@ int main(int argc, char** argv){
     repl();
   }
 
+  else if (argc == 2 && strcmp(argv[1], "--cache-stats") == 0){
+    printCacheStats();
+  }
+
   else if (argc == 2){
     runFile(argv[1]);
   }
 
+  else if (argc == 3 && strcmp(argv[1], "--gc-stats") == 0){
+    showGCStats = true;
+    runFile(argv[2]);
+  }
+
+  else if (argc == 5 && strcmp(argv[1], "--compile") == 0 &&
+           strcmp(argv[3], "-o") == 0){
+    compileFile(argv[2], argv[4]);
+  }
+
   else {
-    fprintf(stderr, "Usage clox: [path]\n");
+    fprintf(stderr, "Usage clox: [--gc-stats] [path]\n");
+    fprintf(stderr, "       clox --compile [path] -o [out.cloxc]\n");
+    fprintf(stderr, "       clox --cache-stats\n");
     exit(64);
   }
 
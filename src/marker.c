@@ -0,0 +1,249 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "marker.h"
+#include "memory.h"
+#include "serialize.h"
+#include "vm.h"
+
+/*
+Concurrent collection cycles. While run() executes, a major collection
+no longer stops the program for the whole mark and sweep:
+
+  initial mark   pause: empty the nursery, gray what is on the stack,
+                 start the marker thread
+  marking        concurrent: the marker grays the globals, their names,
+                 the constant pools, and traces everything gray
+  remark         pause: gray the stack again and the values the write
+                 barrier logged, finish tracing, drop dead strings from
+                 vm.strings, start the sweeper thread
+  sweeping       concurrent: the sweeper frees unmarked objects
+
+Marking is snapshot-at-the-beginning. Every global store made while
+marking goes through storeGlobalWhileMarking(), which logs the value
+being overwritten, so anything reachable when the cycle started is
+marked even if the marker reaches its slot late. The stack is scanned in
+both pauses instead of putting a barrier on every push. Objects
+allocated while marking start out black.
+
+Cycles only start from inside run(). The globals' names and slot table
+and the constant pools only change while compiling or loading, so the
+marker can read them without locking. interpretChunk() finishes any
+cycle in progress before it returns. vm.strings is different: run()
+interns into it while a cycle is going, flattenRope() does. The marker
+thread must never walk it. It is weak anyway, and only remark, in a
+pause on the main thread, drops its white entries. Global slots, and the
+flat string of a rope flattened during the cycle, are read and written
+under barrierLock while marking, which keeps the marker from seeing a
+half written value.
+
+Objects allocated during a cycle are prepended to vm.objects, the
+sweeper only walks the list from where it was at remark and never
+unlinks that first object, so the two threads never write the same
+link.
+*/
+
+typedef enum {
+  MARKER_IDLE,
+  MARKER_MARKING,
+  MARKER_SWEEPING
+} MarkerPhase;
+
+typedef struct {
+  MarkerPhase phase;
+  pthread_t thread;
+  bool hasThread;
+  atomic_bool done;
+  pthread_mutex_t barrierLock;
+
+  // Old values overwritten by the write barrier, grayed at remark.
+  Obj** logged;
+  int loggedCount;
+  int loggedCapacity;
+
+  Obj* sweepFrom;
+  size_t freedBytes; // written by the sweeper, read after joining it
+} Marker;
+
+static Marker marker = {
+  .phase = MARKER_IDLE,
+  .barrierLock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+bool markerActive(){
+  return marker.phase != MARKER_IDLE;
+}
+
+static void logObject(Obj* object){
+  if(marker.loggedCapacity < marker.loggedCount + 1){
+    marker.loggedCapacity = GROW_CAPACITY(marker.loggedCapacity);
+    marker.logged = realloc(marker.logged,
+                            sizeof(Obj*) * marker.loggedCapacity);
+    if(marker.logged == NULL) exit(1);
+  }
+  marker.logged[marker.loggedCount++] = object;
+}
+
+void storeGlobalWhileMarking(Value* global, Value value){
+  pthread_mutex_lock(&marker.barrierLock);
+  Value old = *global;
+  *global = value;
+  pthread_mutex_unlock(&marker.barrierLock);
+
+  if(!IS_OBJ(old) || isYoung(AS_OBJ(old))) return;
+  logObject(AS_OBJ(old));
+}
+
+// Keeps a flattening done during the cycle. The string may be an interned
+// one that only the weak vm.strings still holds, so it is logged and
+// marked at remark like an overwritten global. The rope's children stay,
+// the marker may be tracing them.
+void storeFlatWhileMarking(ObjRope* rope, ObjString* flat){
+  pthread_mutex_lock(&marker.barrierLock);
+  rope->flat = flat;
+  pthread_mutex_unlock(&marker.barrierLock);
+  logObject((Obj*)flat);
+}
+
+ObjString* loadFlat(ObjRope* rope){
+  pthread_mutex_lock(&marker.barrierLock);
+  ObjString* flat = rope->flat;
+  pthread_mutex_unlock(&marker.barrierLock);
+  return flat;
+}
+
+static void* markConcurrently(void* unused){
+  (void)unused;
+  int count = vm.globalValues.count;
+  for(int i = 0; i < count; i++){
+    pthread_mutex_lock(&marker.barrierLock);
+    Value value = vm.globalValues.values[i];
+    pthread_mutex_unlock(&marker.barrierLock);
+    markValue(value);
+  }
+  markArray(&vm.globalNames);
+  markTable(&vm.globalSlots);
+  markArray(&vm.chunk->constants);
+  markCompilerRoots();
+  markBytecodeRoots();
+  traceReferences();
+
+  atomic_store(&marker.done, true);
+  return NULL;
+}
+
+static void* sweepConcurrently(void* unused){
+  (void)unused;
+  Obj* previous = marker.sweepFrom;
+  previous->isMarked = false;
+  Obj* object = previous->next;
+  while(object != NULL){
+    if(object->isMarked){
+      object->isMarked = false;
+      previous = object;
+      object = object->next;
+      continue;
+    }
+
+    Obj* unreached = object;
+    object = object->next;
+    previous->next = object;
+    marker.freedBytes += releaseObject(unreached);
+  }
+
+  atomic_store(&marker.done, true);
+  return NULL;
+}
+
+static void startThread(void* (*function)(void*)){
+  atomic_store(&marker.done, false);
+  marker.hasThread =
+    pthread_create(&marker.thread, NULL, function, NULL) == 0;
+  // No thread to hand the work to, do it right here.
+  if(!marker.hasThread) function(NULL);
+}
+
+static void joinThread(){
+  if(marker.hasThread) pthread_join(marker.thread, NULL);
+  marker.hasThread = false;
+}
+
+void startMarking(){
+  double start = gcClock();
+  collectYoung();
+
+  for(Value* slot = vm.stack; slot < vm.stackTop; slot++){
+    markValue(*slot);
+  }
+  vm.marking = true;
+  marker.phase = MARKER_MARKING;
+  startThread(markConcurrently);
+
+  recordPause(PAUSE_INITIAL_MARK, start);
+}
+
+static void remark(){
+  joinThread();
+
+  for(Value* slot = vm.stack; slot < vm.stackTop; slot++){
+    markValue(*slot);
+  }
+  for(int i = 0; i < marker.loggedCount; i++){
+    markObject(marker.logged[i]);
+  }
+  marker.loggedCount = 0;
+  traceReferences();
+  tableRemoveWhite(&vm.strings);
+  vm.marking = false;
+
+  marker.sweepFrom = vm.objects;
+  marker.freedBytes = 0;
+  marker.phase = MARKER_SWEEPING;
+  if(marker.sweepFrom == NULL){
+    atomic_store(&marker.done, true);
+    return;
+  }
+  startThread(sweepConcurrently);
+}
+
+static void finishSweep(){
+  joinThread();
+  vm.bytesAllocated -= marker.freedBytes;
+  setNextGC();
+  marker.phase = MARKER_IDLE;
+}
+
+// Called at allocation sites, moves the cycle on once the helper thread
+// is done with its phase.
+void pollMarker(){
+  if(!atomic_load(&marker.done)) return;
+
+  double start = gcClock();
+  if(marker.phase == MARKER_MARKING){
+    remark();
+    recordPause(PAUSE_REMARK, start);
+  } else if(marker.phase == MARKER_SWEEPING){
+    finishSweep();
+  }
+}
+
+// Waits for the cycle in progress, if any, to complete.
+void finishMarker(){
+  if(marker.phase == MARKER_IDLE) return;
+
+  double start = gcClock();
+  if(marker.phase == MARKER_MARKING) remark();
+  if(marker.phase == MARKER_SWEEPING) finishSweep();
+  recordPause(PAUSE_REMARK, start);
+}
+
+void freeMarker(){
+  finishMarker();
+  free(marker.logged);
+  marker.logged = NULL;
+  marker.loggedCount = 0;
+  marker.loggedCapacity = 0;
+}
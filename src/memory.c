@@ -1,10 +1,94 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "compiler.h"
+#include "marker.h"
 #include "memory.h"
+#include "serialize.h"
 #include "vm.h"
 
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+
+#define GC_HEAP_GROW_FACTOR 2
+
+// Every pause, minor ones included, is logged so printGCStats() can
+// report percentiles.
+typedef struct {
+  int counts[PAUSE_KIND_COUNT];
+  double* pauses;
+  int pauseCount;
+  int pauseCapacity;
+  size_t promotedBytes;
+} GCStats;
+
+static GCStats gcStats;
+
+double gcClock(){
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void recordPause(PauseKind kind, double start){
+  double pause = gcClock() - start;
+  gcStats.counts[kind]++;
+  if(gcStats.pauseCapacity < gcStats.pauseCount + 1){
+    gcStats.pauseCapacity = GROW_CAPACITY(gcStats.pauseCapacity);
+    gcStats.pauses = realloc(gcStats.pauses,
+                             sizeof(double) * gcStats.pauseCapacity);
+    if(gcStats.pauses == NULL) exit(1);
+  }
+  gcStats.pauses[gcStats.pauseCount++] = pause;
+}
+
+static int comparePauses(const void* a, const void* b){
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest rank, on pauses already sorted.
+static double percentile(double fraction){
+  int rank = (int)(fraction * gcStats.pauseCount + 0.999999);
+  if(rank < 1) rank = 1;
+  return gcStats.pauses[rank - 1];
+}
+
+void printGCStats(){
+  fprintf(stderr, "[stats] gc minor %d, initial mark %d, remark %d, "
+          "full %d, promoted %zu bytes\n",
+          gcStats.counts[PAUSE_MINOR], gcStats.counts[PAUSE_INITIAL_MARK],
+          gcStats.counts[PAUSE_REMARK], gcStats.counts[PAUSE_FULL],
+          gcStats.promotedBytes);
+  if(gcStats.pauseCount > 0){
+    qsort(gcStats.pauses, gcStats.pauseCount, sizeof(double),
+          comparePauses);
+    fprintf(stderr, "[stats] gc pauses %d, p50 %.6fs, p99 %.6fs, "
+            "max %.6fs\n",
+            gcStats.pauseCount, percentile(0.50), percentile(0.99),
+            gcStats.pauses[gcStats.pauseCount - 1]);
+  }
+  memset(gcStats.counts, 0, sizeof(gcStats.counts));
+  gcStats.pauseCount = 0;
+  gcStats.promotedBytes = 0;
+}
+
 void* reallocate(void* pointer, size_t oldSize, size_t newSize){
+  vm.bytesAllocated += newSize - oldSize;
+  if(newSize > oldSize){
+#ifdef DEBUG_STRESS_GC
+    collectGarbage();
+#else
+    if(vm.bytesAllocated > vm.nextGC) collectGarbage();
+    else if(markerActive()) pollMarker();
+#endif
+  }
+
   if(newSize == 0){
     free(pointer);
     return NULL;
@@ -17,6 +101,345 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize){
   return result;
 }
 
+/*
+Generational nursery. Objects made while the program runs are bump
+allocated in a fixed size nursery instead of going through realloc,
+header and payload in one piece. When it fills up, collectYoung() copies
+whatever is still reachable into the old heap and resets the bump
+pointer, so dead young objects cost nothing to free.
+
+Young objects are only reachable from the VM stack and from global
+slots: constants are made by the compiler or the loader, which allocate
+old, and strings hold no references. Global writes go through a barrier
+in run() that records the slot in rememberedGlobals when the value is
+young, so a minor collection only has to look at the stack and those
+slots instead of every global. A promoted object leaves a forwarding
+pointer in its `next` field, which young objects don't otherwise use.
+*/
+
+void initHeap(){
+  vm.bytesAllocated = 0;
+  vm.nextGC = GC_INITIAL_THRESHOLD;
+  vm.grayCount = 0;
+  vm.grayCapacity = 0;
+  vm.grayStack = NULL;
+  vm.marking = false;
+  vm.nursery = malloc(NURSERY_SIZE);
+  if(vm.nursery == NULL) exit(1);
+  vm.nurseryTop = vm.nursery;
+  vm.nurseryEnd = vm.nursery + NURSERY_SIZE;
+  vm.rememberedGlobals = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.isRemembered = NULL;
+  vm.isRememberedCapacity = 0;
+}
+
+// Returns NULL for objects too big for the nursery.
+void* allocateYoung(size_t size){
+  size = (size + 7) & ~(size_t)7;
+  if(size > NURSERY_MAX_OBJECT) return NULL;
+
+#ifdef DEBUG_STRESS_GC
+  collectYoung();
+#endif
+  if(size > (size_t)(vm.nurseryEnd - vm.nurseryTop)){
+    collectYoung();
+    if(vm.bytesAllocated > vm.nextGC) collectGarbage();
+    else if(markerActive()) pollMarker();
+  }
+  void* object = vm.nurseryTop;
+  vm.nurseryTop += size;
+  return object;
+}
+
+void rememberGlobal(int slot){
+  if(slot >= vm.isRememberedCapacity){
+    int oldCapacity = vm.isRememberedCapacity;
+    while(vm.isRememberedCapacity <= slot){
+      vm.isRememberedCapacity = GROW_CAPACITY(vm.isRememberedCapacity);
+    }
+    vm.isRemembered = realloc(vm.isRemembered,
+                              sizeof(bool) * vm.isRememberedCapacity);
+    if(vm.isRemembered == NULL) exit(1);
+    memset(vm.isRemembered + oldCapacity, 0,
+           sizeof(bool) * (vm.isRememberedCapacity - oldCapacity));
+  }
+  if(vm.isRemembered[slot]) return;
+  vm.isRemembered[slot] = true;
+
+  if(vm.rememberedCapacity < vm.rememberedCount + 1){
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.rememberedGlobals = realloc(vm.rememberedGlobals,
+                                   sizeof(int) * vm.rememberedCapacity);
+    if(vm.rememberedGlobals == NULL) exit(1);
+  }
+  vm.rememberedGlobals[vm.rememberedCount++] = slot;
+}
+
+// Counted like any other allocation, but never starts a collection, it
+// is only used while one is running.
+static void* allocateOld(size_t size){
+  vm.bytesAllocated += size;
+  void* result = malloc(size);
+  if(result == NULL) exit(1);
+  return result;
+}
+
+static Obj* promote(Obj* object){
+  if(object->next != NULL) return object->next;
+
+  switch(object->type){
+    case OBJ_STRING: {
+      ObjString* young = (ObjString*)object;
+      size_t size = STRING_SIZE(young->length);
+      ObjString* old = allocateOld(size);
+      memcpy(old, young, size);
+      old->obj.isMarked = vm.marking;
+      old->obj.next = vm.objects;
+      vm.objects = (Obj*)old;
+      object->next = (Obj*)old;
+      gcStats.promotedBytes += size;
+      break;
+    }
+    case OBJ_ROPE: {
+      ObjRope* old = allocateOld(sizeof(ObjRope));
+      *old = *(ObjRope*)object;
+      old->obj.isMarked = vm.marking;
+      old->obj.next = vm.objects;
+      vm.objects = (Obj*)old;
+      object->next = (Obj*)old;
+      gcStats.promotedBytes += sizeof(ObjRope);
+      break;
+    }
+  }
+  return object->next;
+}
+
+static void promoteValue(Value* value){
+  if(IS_OBJ(*value) && isYoung(AS_OBJ(*value))){
+    *value = OBJ_VAL(promote(AS_OBJ(*value)));
+  }
+}
+
+static void promoteField(Obj** field){
+  if(*field != NULL && isYoung(*field)) *field = promote(*field);
+}
+
+// A rope's flat string is never young, only its children can be.
+static void promoteReferences(Obj* object){
+  if(object->type == OBJ_ROPE){
+    promoteField(&((ObjRope*)object)->left);
+    promoteField(&((ObjRope*)object)->right);
+  }
+}
+
+void collectYoung(){
+  double start = gcClock();
+  Obj* scanned = vm.objects;
+
+  for(Value* slot = vm.stack; slot < vm.stackTop; slot++){
+    promoteValue(slot);
+  }
+  for(int i = 0; i < vm.rememberedCount; i++){
+    int slot = vm.rememberedGlobals[i];
+    Value* global = &vm.globalValues.values[slot];
+    Value value = *global;
+    promoteValue(&value);
+    if(vm.marking) storeGlobalWhileMarking(global, value);
+    else *global = value;
+    vm.isRemembered[slot] = false;
+  }
+  vm.rememberedCount = 0;
+
+  // Promoted objects are prepended to vm.objects. Walking the new part of
+  // the list promotes what they refer to, which prepends more, until a
+  // pass finds nothing new.
+  while(vm.objects != scanned){
+    Obj* top = vm.objects;
+    for(Obj* object = top; object != scanned; object = object->next){
+      promoteReferences(object);
+    }
+    scanned = top;
+  }
+  vm.nurseryTop = vm.nursery;
+
+  recordPause(PAUSE_MINOR, start);
+}
+
+/*
+Tracing mark-sweep. Everything the VM can still reach is marked starting
+from the roots: the stack, the global slots and their names, the constant
+pool of the running chunk, and whatever the compiler or the bytecode
+loader is in the middle of building. Marked objects go on the gray stack
+until their own references are visited. vm.strings is weak, interned
+strings that nothing else reaches are dropped from it before the sweep
+frees every object left unmarked.
+
+C code that holds a fresh object in a local while allocating again has
+to push it on the VM stack first, see allocateString() and
+addConstant().
+*/
+
+void markObject(Obj* object){
+  // Young objects are the nursery's business, and while the marker
+  // thread runs it may see a global that still points into it.
+  if(object == NULL || isYoung(object) || object->isMarked) return;
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+  object->isMarked = true;
+
+  if(vm.grayCapacity < vm.grayCount + 1){
+    vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    // Plain realloc, growing the gray stack must not start a collection.
+    vm.grayStack = (Obj**)realloc(vm.grayStack,
+                                  sizeof(Obj*) * vm.grayCapacity);
+    if(vm.grayStack == NULL) exit(1);
+  }
+  vm.grayStack[vm.grayCount++] = object;
+}
+
+void markValue(Value value){
+  if(IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+void markArray(ValueArray* array){
+  for(int i = 0; i < array->count; i++){
+    markValue(array->values[i]);
+  }
+}
+
+static void blackenObject(Obj* object){
+  switch(object->type){
+    case OBJ_STRING:
+      // Strings hold no references.
+      break;
+    case OBJ_ROPE: {
+      ObjRope* rope = (ObjRope*)object;
+      markObject(rope->left);
+      markObject(rope->right);
+      // The marker thread can race a flattening, see marker.c.
+      markObject((Obj*)loadFlat(rope));
+      break;
+    }
+  }
+}
+
+static void markRoots(){
+  for(Value* slot = vm.stack; slot < vm.stackTop; slot++){
+    markValue(*slot);
+  }
+  markArray(&vm.globalValues);
+  markArray(&vm.globalNames);
+  markTable(&vm.globalSlots);
+  if(vm.chunk != NULL) markArray(&vm.chunk->constants);
+  markCompilerRoots();
+  markBytecodeRoots();
+}
+
+void traceReferences(){
+  while(vm.grayCount > 0){
+    blackenObject(vm.grayStack[--vm.grayCount]);
+  }
+}
+
+// Frees an object without going through reallocate(), so the sweeper
+// thread can use it. Returns the bytes released.
+size_t releaseObject(Obj* object){
+  switch(object->type){
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      size_t size = STRING_SIZE(string->length);
+      free(string);
+      return size;
+    }
+    case OBJ_ROPE:
+      free(object);
+      return sizeof(ObjRope);
+  }
+  return 0;
+}
+
+static void sweep(){
+  Obj* previous = NULL;
+  Obj* object = vm.objects;
+  while(object != NULL){
+    if(object->isMarked){
+      object->isMarked = false;
+      previous = object;
+      object = object->next;
+      continue;
+    }
+
+    Obj* unreached = object;
+    object = object->next;
+    if(previous != NULL){
+      previous->next = object;
+    } else {
+      vm.objects = object;
+    }
+    freeObject(unreached);
+  }
+}
+
+void setNextGC(){
+  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  if(vm.nextGC < GC_INITIAL_THRESHOLD) vm.nextGC = GC_INITIAL_THRESHOLD;
+}
+
+// Stops the world for the whole collection. Used outside run(), where
+// the compiler or the loader may be changing the structures the marker
+// thread would read.
+static void collectFull(){
+  finishMarker();
+  collectYoung();
+
+  double start = gcClock();
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm.bytesAllocated;
+#endif
+
+  markRoots();
+  traceReferences();
+  tableRemoveWhite(&vm.strings);
+  sweep();
+  setNextGC();
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated,
+         vm.nextGC);
+#endif
+  recordPause(PAUSE_FULL, start);
+}
+
+void collectGarbage(){
+  // vm.chunk is only set while run() executes.
+  if(vm.chunk == NULL){
+    collectFull();
+    return;
+  }
+
+#ifdef DEBUG_STRESS_GC
+  if(markerActive()) finishMarker();
+  else startMarking();
+#else
+  if(!markerActive()){
+    startMarking();
+  } else if(vm.bytesAllocated > vm.nextGC * GC_HEAP_GROW_FACTOR){
+    // Allocating faster than the cycle can keep up, wait for it.
+    finishMarker();
+  } else {
+    pollMarker();
+  }
+#endif
+}
+
 void freeObjects() {
   Obj* object = vm.objects;
   while (object != NULL) {
@@ -24,4 +447,9 @@ void freeObjects() {
     freeObject(object);   // free current object
     object = next;        // move to next
   }
+  free(vm.grayStack);
+  free(gcStats.pauses);
+  free(vm.nursery);
+  free(vm.rememberedGlobals);
+  free(vm.isRemembered);
 }
@@ -1,59 +1,174 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "hash.h"
+#include "marker.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-  (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_STRING(length) \
+  (ObjString*)allocateObject(STRING_SIZE(length), OBJ_STRING)
 
 static Obj* allocateObject(size_t t, ObjType type){
   Obj* object = (Obj*)reallocate(NULL, 0, t);
   object->type = type;
+  // Black while a concurrent mark runs, the marker may never see it.
+  object->isMarked = vm.marking;
   object->next = vm.objects;
   vm.objects = object;
   return object;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash){
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* allocateString(const char* chars, int length,
+                                 uint32_t hash){
+  ObjString* string = ALLOCATE_STRING(length);
   string->length = length;
-  string->chars = chars;
   string->hash = hash;
+  memcpy(string->chars, chars, length);
+  string->chars[length] = '\0';
+  // Growing the intern table can collect, and nothing refers to the
+  // new string yet.
+  push(OBJ_VAL(string));
   tableSet(&vm.strings, string, NIL_VAL);
+  pop();
   return string;
 }
 
-static uint32_t hashString(const char* key, int length){
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
-}
-
 ObjString* copyString(const char* chars, int length){
   uint32_t hash = hashString(chars, length);
   ObjString* interned = tableFindString(&vm.strings, chars, length,
                                         hash);
   if (interned != NULL) return interned;
-  char* heapChars = ALLOCATE(char, length+2);
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  return allocateString(chars, length, hash);
 }
 
-ObjString* takeString(char* chars, int length){
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
-                                        hash);
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
+/*
+Strings made while the program runs, like the result of a concatenation,
+start out in the nursery with their characters right after the header.
+They are not interned: most die before anything looks at them again, and
+valuesEqual() compares characters when two string pointers differ. The
+caller fills in chars and then calls finishString().
+*/
+ObjString* newString(int length){
+  ObjString* string = allocateYoung(STRING_SIZE(length));
+  if(string != NULL){
+    string->obj.type = OBJ_STRING;
+    string->obj.isMarked = false;
+    string->obj.next = NULL;
+  } else {
+    // Too big for the nursery.
+    string = ALLOCATE_STRING(length);
   }
-  return allocateString(chars, length, hash);
+  string->length = length;
+  return string;
+}
+
+void finishString(ObjString* string){
+  string->chars[string->length] = '\0';
+  string->hash = hashString(string->chars, string->length);
+}
+
+/*
+Ropes are made by concatenate() once a result gets long enough that
+copying both sides every time would make building a string piece by
+piece quadratic. The caller fills in the fields.
+*/
+ObjRope* newRope(){
+  // Always small enough for the nursery, so the children the caller
+  // stores may be young too.
+  ObjRope* rope = allocateYoung(sizeof(ObjRope));
+  rope->obj.type = OBJ_ROPE;
+  rope->obj.isMarked = false;
+  rope->obj.next = NULL;
+  rope->left = NULL;
+  rope->right = NULL;
+  rope->flat = NULL;
+  return rope;
 }
 
+/*
+Writes the characters of a string or a rope to dest. The walk goes right
+to left with its own stack: `s = s + piece;` builds a rope as deep as it
+has pieces, which would overflow the C stack in a recursive walk. Left
+deep ropes only ever need two entries.
+*/
+void copyChars(Obj* string, char* dest){
+  char* end = dest + stringLength(string);
+  int capacity = 8;
+  int count = 0;
+  Obj** pending = malloc(sizeof(Obj*) * capacity);
+  if(pending == NULL) exit(1);
+  pending[count++] = string;
+
+  while(count > 0){
+    Obj* object = pending[--count];
+    if(object->type == OBJ_ROPE && ((ObjRope*)object)->flat != NULL){
+      object = (Obj*)((ObjRope*)object)->flat;
+    }
+    if(object->type == OBJ_STRING){
+      ObjString* leaf = (ObjString*)object;
+      end -= leaf->length;
+      memcpy(end, leaf->chars, leaf->length);
+      continue;
+    }
+
+    ObjRope* rope = (ObjRope*)object;
+    if(capacity < count + 2){
+      capacity = GROW_CAPACITY(capacity);
+      pending = realloc(pending, sizeof(Obj*) * capacity);
+      if(pending == NULL) exit(1);
+    }
+    pending[count++] = rope->left;
+    pending[count++] = rope->right;
+  }
+  free(pending);
+}
+
+/*
+Puts the rope in the slot together into one interned string. The slot
+has to be a GC root, the allocations here can collect and move a young
+rope. The result is kept in the rope and its children are dropped. While
+the marker thread runs it may be reading the rope, so then the string
+is stored through the marker's barrier and the children are only
+dropped the next time the rope is flattened outside a cycle.
+*/
+ObjString* flattenRope(Value* rope){
+  ObjRope* flattened = AS_ROPE(*rope);
+  if(flattened->flat != NULL){
+    if(!vm.marking){
+      flattened->left = NULL;
+      flattened->right = NULL;
+    }
+    return flattened->flat;
+  }
+
+  // Old, not young: it is stored in a rope that may be old itself.
+  int length = AS_ROPE(*rope)->length;
+  ObjString* string = ALLOCATE_STRING(length);
+  string->length = length;
+  copyChars(AS_OBJ(*rope), string->chars);
+  finishString(string);
+
+  ObjString* interned = tableFindString(&vm.strings, string->chars,
+                                        length, string->hash);
+  if(interned != NULL){
+    string = interned;
+  } else {
+    push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+  }
+
+  // Allocating may have moved a young rope.
+  flattened = AS_ROPE(*rope);
+  if(vm.marking){
+    storeFlatWhileMarking(flattened, string);
+  } else {
+    flattened->flat = string;
+    flattened->left = NULL;
+    flattened->right = NULL;
+  }
+  return string;
+}
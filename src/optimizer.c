@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "memory.h"
+#include "optimizer.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+/*
+Peephole pass over a finished chunk.
+
+Instructions are copied one at a time into a fresh chunk. Before copying,
+each one is checked against the last instruction already written out, so
+a rewrite that exposes a new window (say, removing OP_CONSTANT; OP_POP
+brings two other instructions together) is picked up without a second
+pass. Lines are carried over through writeChunk(), and every rewrite that
+shortens the output goes through truncateChunk() so the run-length line
+table never covers bytes that are gone.
+
+Jumps make that a little harder. An instruction some jump lands on
+starts a new block: nothing is merged into what was written before it,
+since the jump would then skip part of the merged instruction. The
+windows below look back through lastStart() and secondLastStart(),
+which stop at the block start. The new offset of every old instruction
+is recorded as it is copied, and once the pass is done every jump is
+pointed at the new offset of its old target. Code only ever shrinks
+here, so the distances still fit.
+*/
+
+typedef struct {
+  int offset;    // in out
+  int oldTarget; // in the chunk being optimized
+} Jump;
+
+typedef struct {
+  Chunk out;
+  int* starts;    // offset of every instruction written to out
+  int count;
+  int blockStart; // index in starts of the first instruction of the block
+  int* moved;     // old offset -> new offset
+  Jump* jumps;    // every jump copied
+  int jumpCount;
+} Peephole;
+
+static void copyInstruction(Peephole* p, Chunk* chunk, int offset){
+  if(isJump(chunk->code[offset])){
+    Jump* jump = &p->jumps[p->jumpCount++];
+    jump->offset = p->out.count;
+    jump->oldTarget = jumpTarget(chunk->code, offset);
+  }
+  p->starts[p->count++] = p->out.count;
+  int length = opcodeLength(chunk->code[offset]);
+  int line = getLine(chunk, offset);
+  for(int i = 0; i < length; i++){
+    writeChunk(&p->out, chunk->code[offset + i], line);
+  }
+}
+
+static int lastStart(Peephole* p){
+  return p->count > p->blockStart ? p->starts[p->count - 1] : -1;
+}
+
+static void dropLast(Peephole* p){
+  truncateChunk(&p->out, p->starts[--p->count]);
+}
+
+// The instruction written before the last one, if any.
+static int secondLastStart(Peephole* p){
+  return p->count > p->blockStart + 1 ? p->starts[p->count - 2] : -1;
+}
+
+// Fuses the last two instructions written, [a][operand] [b] or
+// [a] [b][operand], into a single [fused][operand].
+static void fuseLastTwo(Peephole* p, uint8_t fused, uint8_t operand){
+  int start = secondLastStart(p);
+  int line = getLine(&p->out, start);
+  p->count--;
+  truncateChunk(&p->out, start);
+  writeChunk(&p->out, fused, line);
+  writeChunk(&p->out, operand, line);
+}
+
+static bool isConstantLoad(uint8_t opcode){
+  switch(opcode){
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/*
+Superinstructions. The pairs chosen here are the hottest ones in the
+DEBUG_STATS pair profile of our benchmark scripts:
+
+  a = a + 1;   OP_GET_GLOBAL, OP_CONSTANT, OP_ADD, OP_SET_GLOBAL, OP_POP
+          ->   OP_GLOBAL_ADD_CONSTANT, OP_SET_GLOBAL_POP
+
+  t = t + c;   OP_GET_GLOBAL, OP_GET_GLOBAL, OP_ADD, OP_SET_GLOBAL, OP_POP
+          ->   OP_GET_GLOBAL, OP_GET_GLOBAL, OP_ADD_SET_GLOBAL_POP
+*/
+
+// [OP_GET_GLOBAL g] [OP_CONSTANT c] + arithmetic.
+static bool fuseGlobalConstant(Peephole* p, uint8_t arithmetic){
+  int constant = lastStart(p);
+  int global = secondLastStart(p);
+  if(global < 0) return false;
+  uint8_t* code = p->out.code;
+  if(code[global] != OP_GET_GLOBAL || code[constant] != OP_CONSTANT){
+    return false;
+  }
+
+  switch(arithmetic){
+    case OP_ADD: code[global] = OP_GLOBAL_ADD_CONSTANT; break;
+    case OP_SUBTRACT: code[global] = OP_GLOBAL_SUBTRACT_CONSTANT; break;
+    case OP_MULTIPLY: code[global] = OP_GLOBAL_MULTIPLY_CONSTANT; break;
+    case OP_DIVIDE: code[global] = OP_GLOBAL_DIVIDE_CONSTANT; break;
+    default: return false;
+  }
+  // The constant's operand is already in place, only its opcode goes.
+  code[constant] = code[constant + 1];
+  truncateChunk(&p->out, constant + 1);
+  p->count--;
+  return true;
+}
+
+// [OP_ADD] [OP_SET_GLOBAL_POP g], called right after the pop is fused.
+static void fuseArithmeticStore(Peephole* p){
+  int store = lastStart(p);
+  int arithmetic = secondLastStart(p);
+  if(arithmetic < 0) return;
+  uint8_t* code = p->out.code;
+  uint8_t slot = code[store + 1];
+  switch(code[arithmetic]){
+    case OP_ADD: fuseLastTwo(p, OP_ADD_SET_GLOBAL_POP, slot); break;
+    case OP_SUBTRACT: fuseLastTwo(p, OP_SUBTRACT_SET_GLOBAL_POP, slot); break;
+    default: break;
+  }
+}
+
+// Tries to merge the instruction at offset into the last one written.
+// Returns true when nothing more needs copying.
+static bool combine(Peephole* p, Chunk* chunk, int offset){
+  int last = lastStart(p);
+  if(last < 0) return false;
+
+  uint8_t* previous = &p->out.code[last];
+  switch(chunk->code[offset]){
+    case OP_POP:
+      // A value pushed only to be popped again.
+      if(isConstantLoad(previous[0])){
+        dropLast(p);
+        return true;
+      }
+      if(previous[0] == OP_DEFINE_GLOBAL_KEEP){
+        previous[0] = OP_DEFINE_GLOBAL;
+        return true;
+      }
+      if(previous[0] == OP_SET_GLOBAL){
+        previous[0] = OP_SET_GLOBAL_POP;
+        fuseArithmeticStore(p);
+        return true;
+      }
+      if(previous[0] == OP_SET_LOCAL){
+        previous[0] = OP_SET_LOCAL_POP;
+        return true;
+      }
+      return false;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return fuseGlobalConstant(p, chunk->code[offset]);
+    case OP_NOT:
+      if(previous[0] == OP_EQUAL){
+        previous[0] = OP_NOT_EQUAL;
+        return true;
+      }
+      return false;
+    case OP_GET_GLOBAL:
+      // var a = ...; a ... : keep the value instead of reloading it.
+      if(previous[0] == OP_DEFINE_GLOBAL &&
+         previous[1] == chunk->code[offset + 1]){
+        previous[0] = OP_DEFINE_GLOBAL_KEEP;
+        return true;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+// Marks every offset some jump in chunk lands on.
+static bool* findTargets(Chunk* chunk){
+  bool* targets = calloc(chunk->count + 1, sizeof(bool));
+  if(targets == NULL) exit(1);
+  for(int offset = 0; offset < chunk->count;){
+    uint8_t opcode = chunk->code[offset];
+    if(isJump(opcode)) targets[jumpTarget(chunk->code, offset)] = true;
+    offset += opcodeLength(opcode);
+  }
+  return targets;
+}
+
+void optimizeChunk(Chunk* chunk){
+  Peephole p;
+  initChunk(&p.out);
+  p.starts = malloc(sizeof(int) * (chunk->count + 1));
+  p.count = 0;
+  p.blockStart = 0;
+  p.moved = malloc(sizeof(int) * (chunk->count + 1));
+  p.jumps = malloc(sizeof(Jump) * (chunk->count / 3 + 1));
+  p.jumpCount = 0;
+  if(p.starts == NULL || p.moved == NULL || p.jumps == NULL) exit(1);
+  bool* targets = findTargets(chunk);
+
+  for(int offset = 0; offset < chunk->count;){
+    uint8_t opcode = chunk->code[offset];
+    if(targets[offset]) p.blockStart = p.count;
+    p.moved[offset] = p.out.count;
+    if(!combine(&p, chunk, offset)){
+      copyInstruction(&p, chunk, offset);
+    }
+    offset += opcodeLength(opcode);
+
+    // The compiler only emits a return at the very end.
+    if(opcode == OP_RETURN) break;
+  }
+
+  // Jumps were copied with their old distances, which only make sense
+  // from their old offsets.
+  for(int i = 0; i < p.jumpCount; i++){
+    Jump* jump = &p.jumps[i];
+    setJumpTarget(p.out.code, jump->offset, p.moved[jump->oldTarget]);
+  }
+
+#ifdef DEBUG_PRINT_CODE
+  printf("== peephole saved %d bytes ==\n", chunk->count - p.out.count);
+#endif
+
+  free(targets);
+  free(p.moved);
+  free(p.jumps);
+  free(p.starts);
+  p.out.constants = chunk->constants;
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  *chunk = p.out;
+
+#ifdef DEBUG_PRINT_CODE
+  disassembleChunk(chunk, "optimized");
+#endif
+}
@@ -3,7 +3,10 @@
 #include <stdbool.h>
 #include "common.h"
 #include "scanner.h"
-#include "hashtable.h"
+
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
 
 static bool isAtEnd();
 static char advance();
@@ -15,57 +18,136 @@ static bool isDigit(char);
 static bool isAlpha(char);
 static Token identifier();
 static Token number();
-TokenType identifierType();
+static TokenType identifierType();
+
+#define CHAR_ALPHA 1
+#define CHAR_DIGIT 2
+
+// Identifier characters by class, one load instead of a chain of range
+// checks.
+static const uint8_t charClass[256] = {
+  ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT,
+  ['3'] = CHAR_DIGIT, ['4'] = CHAR_DIGIT, ['5'] = CHAR_DIGIT,
+  ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT, ['8'] = CHAR_DIGIT,
+  ['9'] = CHAR_DIGIT,
+  ['A'] = CHAR_ALPHA, ['B'] = CHAR_ALPHA, ['C'] = CHAR_ALPHA,
+  ['D'] = CHAR_ALPHA, ['E'] = CHAR_ALPHA, ['F'] = CHAR_ALPHA,
+  ['G'] = CHAR_ALPHA, ['H'] = CHAR_ALPHA, ['I'] = CHAR_ALPHA,
+  ['J'] = CHAR_ALPHA, ['K'] = CHAR_ALPHA, ['L'] = CHAR_ALPHA,
+  ['M'] = CHAR_ALPHA, ['N'] = CHAR_ALPHA, ['O'] = CHAR_ALPHA,
+  ['P'] = CHAR_ALPHA, ['Q'] = CHAR_ALPHA, ['R'] = CHAR_ALPHA,
+  ['S'] = CHAR_ALPHA, ['T'] = CHAR_ALPHA, ['U'] = CHAR_ALPHA,
+  ['V'] = CHAR_ALPHA, ['W'] = CHAR_ALPHA, ['X'] = CHAR_ALPHA,
+  ['Y'] = CHAR_ALPHA, ['Z'] = CHAR_ALPHA, ['_'] = CHAR_ALPHA,
+  ['a'] = CHAR_ALPHA, ['b'] = CHAR_ALPHA, ['c'] = CHAR_ALPHA,
+  ['d'] = CHAR_ALPHA, ['e'] = CHAR_ALPHA, ['f'] = CHAR_ALPHA,
+  ['g'] = CHAR_ALPHA, ['h'] = CHAR_ALPHA, ['i'] = CHAR_ALPHA,
+  ['j'] = CHAR_ALPHA, ['k'] = CHAR_ALPHA, ['l'] = CHAR_ALPHA,
+  ['m'] = CHAR_ALPHA, ['n'] = CHAR_ALPHA, ['o'] = CHAR_ALPHA,
+  ['p'] = CHAR_ALPHA, ['q'] = CHAR_ALPHA, ['r'] = CHAR_ALPHA,
+  ['s'] = CHAR_ALPHA, ['t'] = CHAR_ALPHA, ['u'] = CHAR_ALPHA,
+  ['v'] = CHAR_ALPHA, ['w'] = CHAR_ALPHA, ['x'] = CHAR_ALPHA,
+  ['y'] = CHAR_ALPHA, ['z'] = CHAR_ALPHA,
+};
 
 static bool isAlpha(char c){
-  return (
-      (c >= 'a' && c <= 'z')
-      ||
-      (c >= 'A' && c <= 'Z')
-      ||
-      (c == '_')
-  );
+  return charClass[(uint8_t)c] & CHAR_ALPHA;
+}
+
+// Most tokens are one space apart, only a second whitespace character in
+// a row is worth a vector load.
+static bool isSpace(char c){
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
 
 typedef struct {
   const char* start; // begining
   const char* current; // lexeme being looked at
+  const char* end; // the terminating NUL, vector loads stop before it
   int line;
-  HashMap map;
 } Scanner;
 
 Scanner scanner;
 
-void buildIdent(){
-  addKey("var", (void*)TOKEN_VAR, &scanner.map);
-  addKey("this", (void*)TOKEN_THIS, &scanner.map);
-  addKey("and", (void*)TOKEN_AND, &scanner.map);
-  addKey("class", (void*)TOKEN_CLASS, &scanner.map);
-  addKey("else", (void*)TOKEN_ELSE, &scanner.map);
-  addKey("false", (void*)TOKEN_FALSE, &scanner.map);
-  addKey("for", (void*)TOKEN_FOR, &scanner.map);
-  addKey("fun", (void*)TOKEN_FUN, &scanner.map);
-  addKey("if", (void*)TOKEN_IF, &scanner.map);
-  addKey("nil", (void*)TOKEN_NIL, &scanner.map);
-  addKey("or", (void*)TOKEN_OR, &scanner.map);
-  addKey("print", (void*)TOKEN_PRINT, &scanner.map);
-  addKey("return", (void*)TOKEN_RETURN, &scanner.map);
-  addKey("super", (void*)TOKEN_SUPER, &scanner.map);
-  addKey("this", (void*)TOKEN_THIS, &scanner.map);
-  addKey("true", (void*)TOKEN_TRUE, &scanner.map);
-  addKey("var", (void*)TOKEN_VAR, &scanner.map);
-  addKey("while", (void*)TOKEN_WHILE, &scanner.map);
-}
-
 void initScanner(const char* source){
   scanner.start = source;
   scanner.current = source;
+  scanner.end = source + strlen(source);
   scanner.line = 1;
-  scanner.map.capacity  = INITIAL_CAPACITY;
-  scanner.map.entries   = calloc(INITIAL_CAPACITY, sizeof(HashEntry*));
-  buildIdent();
 }
 
+/*
+Vector fast paths. Whitespace runs, comments and string bodies are
+scanned 16 bytes at a time with SSE2 compares, and the newlines in what
+was skipped are counted from the same compare masks. A full 16 byte
+load is only made when it ends at or before scanner.end, the last few
+bytes of the source always take the scalar loop after it. Identifiers
+and numbers are short, they use the charClass table instead.
+*/
+#ifdef USE_SSE2
+static inline __m128i loadBytes(const char* p){
+  return _mm_loadu_si128((const __m128i*)p);
+}
+
+static inline uint32_t matchChar(__m128i bytes, char c){
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+}
+
+// Skips spaces, tabs, carriage returns and newlines.
+static void skipSpaceRun(){
+  while(scanner.end - scanner.current >= 16){
+    __m128i bytes = loadBytes(scanner.current);
+    uint32_t newlines = matchChar(bytes, '\n');
+    uint32_t space = matchChar(bytes, ' ') | matchChar(bytes, '\t') |
+                     matchChar(bytes, '\r') | newlines;
+    uint32_t other = ~space & 0xffff;
+    if(other == 0){
+      scanner.line += countBits(newlines);
+      scanner.current += 16;
+      continue;
+    }
+    int skipped = lowestBit(other);
+    scanner.line += countBits(newlines & ((1u << skipped) - 1));
+    scanner.current += skipped;
+    return;
+  }
+}
+
+// Moves to the next newline, or as close to the end as a load can go.
+static void skipToNewline(){
+  while(scanner.end - scanner.current >= 16){
+    uint32_t newline = matchChar(loadBytes(scanner.current), '\n');
+    if(newline != 0){
+      scanner.current += lowestBit(newline);
+      return;
+    }
+    scanner.current += 16;
+  }
+}
+
+// Moves to the next '"', counting the newlines passed on the way.
+static void skipStringBody(){
+  while(scanner.end - scanner.current >= 16){
+    __m128i bytes = loadBytes(scanner.current);
+    uint32_t quote = matchChar(bytes, '"');
+    uint32_t newlines = matchChar(bytes, '\n');
+    if(quote == 0){
+      scanner.line += countBits(newlines);
+      scanner.current += 16;
+      continue;
+    }
+    int length = lowestBit(quote);
+    scanner.line += countBits(newlines & ((1u << length) - 1));
+    scanner.current += length;
+    return;
+  }
+}
+#else
+static void skipSpaceRun(){}
+static void skipToNewline(){}
+static void skipStringBody(){}
+#endif
+
 Token scanToken(){
   skipWhitespace();
   scanner.start = scanner.current;
@@ -107,29 +189,64 @@ Token scanToken(){
 }
 
 static Token identifier(){
-  while(isAlpha(peek()) || isDigit(peek())) advance();
+  while(charClass[(uint8_t)*scanner.current] != 0) scanner.current++;
   return makeToken(identifierType());
 }
 
-TokenType identifierType(){
-  size_t len = scanner.current - scanner.start;
-  char *ident = malloc(len + 1);
-  ident[len] = '\0';
-  memcpy(ident, scanner.start, len);
-  HashEntry* entry = getEntry(ident, &scanner.map);
-  TokenType result;
-  if(entry == NULL){
-    result = TOKEN_IDENTIFIER;
+// The rest of a keyword candidate, compared in place on the lexeme.
+static TokenType checkKeyword(int start, int length, const char* rest,
+                              TokenType type){
+  if(scanner.current - scanner.start == start + length &&
+     memcmp(scanner.start + start, rest, length) == 0){
+    return type;
   }
-  else{
-    result = (TokenType)(intptr_t)entry->value;
+  return TOKEN_IDENTIFIER;
+}
+
+/*
+Keywords are recognized by a trie written out as switches: the first
+letter, and where several keywords share it the second, pick the one
+keyword the lexeme can still be, and the rest is a single memcmp. No
+lexeme is ever copied and nothing has to be set up per scan.
+*/
+static TokenType identifierType(){
+  switch(scanner.start[0]){
+    case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
+    case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+    case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+    case 'f':
+      if(scanner.current - scanner.start > 1){
+        switch(scanner.start[1]){
+          case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+          case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
+          case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
+        }
+      }
+      break;
+    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
+    case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
+    case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
+    case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
+    case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
+    case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+    case 't':
+      if(scanner.current - scanner.start > 1){
+        switch(scanner.start[1]){
+          case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
+          case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+        }
+      }
+      break;
+    case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
+    case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
   }
-  free(ident);
-  return result;
+  return TOKEN_IDENTIFIER;
 }
 
 static Token string(){
+  skipStringBody();
   while(peek() != '"' && !isAtEnd()){
+    if(peek() == '\n') scanner.line++;
     advance();
   }
 
@@ -152,11 +269,11 @@ static Token number(){
 }
 
 static bool isDigit(char num){
-  return num >= '0' && num <= '9';
+  return charClass[(uint8_t)num] & CHAR_DIGIT;
 }
 
 static bool isAtEnd() {
-  return *scanner.current == '\0';
+  return scanner.current >= scanner.end;
 }
 
 Token makeToken(TokenType type){
@@ -206,17 +323,21 @@ static void skipWhitespace(){
       case '\r':
       case '\t':
         advance();
+        if(isSpace(peek())) skipSpaceRun();
         break;
       case '\n':
         scanner.line++;
         advance();
+        if(isSpace(peek())) skipSpaceRun();
         break;
       case '/':
         if(peekNext() == '/'){
-          while(peek() != '\0' && !isAtEnd()) advance();
-        } else{
-          return;
+          // A comment goes until the end of the line.
+          skipToNewline();
+          while(peek() != '\n' && !isAtEnd()) advance();
+          break;
         }
+        return;
       default:
         return;
     }
@@ -0,0 +1,495 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "object.h"
+#include "serialize.h"
+#include "vm.h"
+
+/*
+Layout of a .cloxc file. Fields are written in the byte order of the
+machine that compiled it, byteOrder lets a reader on another machine
+notice and refuse the file.
+
+  header      BytecodeHeader
+  code        codeLength bytes
+  padding     up to a 4 byte boundary
+  lines       lineCount LineStarts
+  constants   constantCount entries, a tag byte followed by either an
+              8 byte double or a uint32 length and the string's bytes
+  globals     globalCount names in slot order, uint32 length and bytes
+
+Code and lines are used in place from the mapping. Constants are turned
+back into Values, strings through copyString() so they are interned like
+compiled ones. Global names are resolved through globalSlot() again, and
+operands are rewritten when a name lands in a different slot than it had
+in the compiling VM.
+*/
+
+#define BYTECODE_MAGIC "CLXC"
+#define BYTE_ORDER_MARK 0x01020304u
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint32_t codeLength;
+  uint32_t lineCount;
+  uint32_t constantCount;
+  uint32_t globalCount;
+  uint32_t reserved;
+} BytecodeHeader;
+
+typedef enum {
+  CONSTANT_NUMBER,
+  CONSTANT_STRING
+} ConstantTag;
+
+static size_t linesOffset(uint32_t codeLength){
+  return (sizeof(BytecodeHeader) + codeLength + 3) & ~(size_t)3;
+}
+
+static void writeString(FILE* file, ObjString* string){
+  uint32_t length = (uint32_t)string->length;
+  fwrite(&length, sizeof(length), 1, file);
+  fwrite(string->chars, 1, string->length, file);
+}
+
+bool writeBytecode(Chunk* chunk, const char* path){
+  FILE* file = fopen(path, "wb");
+  if(file == NULL) return false;
+
+  BytecodeHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+  header.version = BYTECODE_VERSION;
+  header.byteOrder = BYTE_ORDER_MARK;
+  header.codeLength = chunk->count;
+  header.lineCount = chunk->lineCount;
+  header.constantCount = chunk->constants.count;
+  header.globalCount = vm.globalNames.count;
+  fwrite(&header, sizeof(header), 1, file);
+
+  static const uint8_t padding[3];
+  fwrite(chunk->code, 1, chunk->count, file);
+  fwrite(padding, 1,
+         linesOffset(chunk->count) - sizeof(header) - chunk->count, file);
+  fwrite(chunk->lines, sizeof(LineStart), chunk->lineCount, file);
+
+  bool ok = true;
+  for(int i = 0; i < chunk->constants.count; i++){
+    Value value = chunk->constants.values[i];
+    if(IS_NUMBER(value)){
+      uint8_t tag = CONSTANT_NUMBER;
+      double number = AS_NUMBER(value);
+      fwrite(&tag, 1, 1, file);
+      fwrite(&number, sizeof(number), 1, file);
+    } else if(IS_STRING(value)){
+      uint8_t tag = CONSTANT_STRING;
+      fwrite(&tag, 1, 1, file);
+      writeString(file, AS_STRING(value));
+    } else {
+      // The compiler only pools numbers and strings.
+      ok = false;
+    }
+  }
+
+  for(int i = 0; i < vm.globalNames.count; i++){
+    writeString(file, AS_STRING(vm.globalNames.values[i]));
+  }
+
+  if(ferror(file)) ok = false;
+  if(fclose(file) != 0) ok = false;
+  if(!ok) remove(path);
+  return ok;
+}
+
+typedef struct {
+  const uint8_t* current;
+  const uint8_t* end;
+} Reader;
+
+static bool readBytes(Reader* reader, void* out, size_t size){
+  if((size_t)(reader->end - reader->current) < size) return false;
+  memcpy(out, reader->current, size);
+  reader->current += size;
+  return true;
+}
+
+static ObjString* readString(Reader* reader){
+  uint32_t length;
+  if(!readBytes(reader, &length, sizeof(length))) return NULL;
+  if(length > INT_MAX ||
+     (size_t)(reader->end - reader->current) < length){
+    return NULL;
+  }
+  ObjString* string = copyString((const char*)reader->current, (int)length);
+  reader->current += length;
+  return string;
+}
+
+// Decodes the global slot and constant index an instruction refers to,
+// -1 for the ones it does not have. The global operand always follows
+// the opcode directly, wide is set when it is 24 bits.
+static void decodeOperands(const uint8_t* code, int* global, int* constant,
+                           bool* wide){
+  *global = -1;
+  *constant = -1;
+  *wide = false;
+  switch(code[0]){
+    case OP_CONSTANT:
+      *constant = code[1];
+      break;
+    case OP_CONSTANT_LONG:
+      *constant = readUint24(&code[1]);
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_KEEP:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+    case OP_ADD_SET_GLOBAL_POP:
+    case OP_SUBTRACT_SET_GLOBAL_POP:
+      *global = code[1];
+      break;
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+      *global = readUint24(&code[1]);
+      *wide = true;
+      break;
+    case OP_GLOBAL_ADD_CONSTANT:
+    case OP_GLOBAL_SUBTRACT_CONSTANT:
+    case OP_GLOBAL_MULTIPLY_CONSTANT:
+    case OP_GLOBAL_DIVIDE_CONSTANT:
+      *global = code[1];
+      *constant = code[2];
+      break;
+    default:
+      break;
+  }
+}
+
+// The step, and a constant bound, are added and compared without a type
+// check.
+static const char* checkForStep(Chunk* chunk, const uint8_t* code){
+  ValueArray* constants = &chunk->constants;
+  uint8_t mode = code[4];
+  if(mode > (FOR_STEP_COMPARE | FOR_STEP_CONSTANT_BOUND)){
+    return "unknown loop mode";
+  }
+  if(code[2] >= constants->count || !IS_NUMBER(constants->values[code[2]])){
+    return "loop step is not a number constant";
+  }
+  if((mode & FOR_STEP_CONSTANT_BOUND) &&
+     (code[3] >= constants->count ||
+      !IS_NUMBER(constants->values[code[3]]))){
+    return "loop bound is not a number constant";
+  }
+  return NULL;
+}
+
+// Every instruction has to be a known opcode whose operands stay inside
+// the code, the constant pool and the global table, and the chunk has
+// to end by returning, otherwise run() would walk off the end.
+static const char* checkInstructions(Chunk* chunk, int globalCount,
+                                     bool* starts){
+  uint8_t last = OPCODE_COUNT;
+  for(int offset = 0; offset < chunk->count;){
+    uint8_t opcode = chunk->code[offset];
+    if(opcode >= OPCODE_COUNT) return "unknown opcode";
+    int length = opcodeLength(opcode);
+    if(length > chunk->count - offset) return "truncated instruction";
+
+    int global, constant;
+    bool wide;
+    decodeOperands(&chunk->code[offset], &global, &constant, &wide);
+    if(global >= globalCount) return "global slot out of range";
+    if(constant >= chunk->constants.count) return "constant out of range";
+    if(opcode == OP_CONCAT_N && chunk->code[offset + 1] < 2){
+      return "concatenation of fewer than two values";
+    }
+    if(opcode == OP_FOR_STEP){
+      const char* error = checkForStep(chunk, &chunk->code[offset]);
+      if(error != NULL) return error;
+    }
+
+    starts[offset] = true;
+    last = opcode;
+    offset += length;
+  }
+  if(last != OP_RETURN) return "code does not end in a return";
+  return NULL;
+}
+
+/*
+Follows the stack depth through the code. No instruction may pop more
+than is there or touch a local slot above the top, and every jump has to
+land on an instruction, with the same depth as every other way of
+getting there. Each instruction gets the depth of the one before it, or
+of the first jump to it when nothing falls through. Since every edge is
+checked against that, the depths hold on every path, including code only
+a later backward jump reaches. The deepest point becomes the chunk's
+maxStack, which the VM sizes its stack by.
+*/
+static const char* checkStack(Chunk* chunk, const bool* starts,
+                              int* depths){
+  for(int offset = 0; offset < chunk->count; offset++) depths[offset] = -1;
+  chunk->maxStack = 0;
+
+  int depth = 0;
+  bool fallsThrough = true;
+  for(int offset = 0; offset < chunk->count;){
+    uint8_t* code = &chunk->code[offset];
+    if(depths[offset] == -1){
+      depths[offset] = depth;
+    } else if(fallsThrough && depths[offset] != depth){
+      return "stack depth differs at a jump target";
+    } else {
+      depth = depths[offset];
+    }
+
+    int pops, pushes;
+    stackEffect(code, &pops, &pushes);
+    if(pops > depth) return "stack underflow";
+    if((code[0] == OP_GET_LOCAL || code[0] == OP_SET_LOCAL ||
+        code[0] == OP_SET_LOCAL_POP || code[0] == OP_FOR_STEP) &&
+       code[1] >= depth){
+      return "local slot out of range";
+    }
+    if(code[0] == OP_FOR_STEP && !(code[4] & FOR_STEP_CONSTANT_BOUND) &&
+       code[3] >= depth){
+      return "local slot out of range";
+    }
+    depth += pushes - pops;
+    if(depth > chunk->maxStack) chunk->maxStack = depth;
+
+    if(isJump(code[0])){
+      int target = jumpTarget(chunk->code, offset);
+      if(target < 0 || target >= chunk->count || !starts[target]){
+        return "jump into the middle of an instruction";
+      }
+      if(depths[target] == -1){
+        depths[target] = depth;
+      } else if(depths[target] != depth){
+        return "stack depth differs at a jump target";
+      }
+    }
+
+    fallsThrough = code[0] != OP_JUMP && code[0] != OP_LOOP &&
+                   code[0] != OP_RETURN;
+    offset += opcodeLength(code[0]);
+  }
+  return NULL;
+}
+
+static const char* checkCode(Chunk* chunk, int globalCount){
+  bool* starts = calloc(chunk->count + 1, sizeof(bool));
+  int* depths = malloc(sizeof(int) * (chunk->count + 1));
+  if(starts == NULL || depths == NULL) exit(1);
+
+  const char* error = checkInstructions(chunk, globalCount, starts);
+  if(error == NULL) error = checkStack(chunk, starts, depths);
+  free(starts);
+  free(depths);
+  return error;
+}
+
+static const char* checkLines(Chunk* chunk){
+  if(chunk->lineCount == 0 || chunk->lines[0].offset != 0){
+    return "line table does not cover the code";
+  }
+  for(int i = 0; i < chunk->lineCount; i++){
+    int offset = chunk->lines[i].offset;
+    if(offset >= chunk->count ||
+       (i > 0 && offset <= chunk->lines[i - 1].offset)){
+      return "line table out of order";
+    }
+  }
+  return NULL;
+}
+
+// The chunk being loaded, its constants are collector roots until it is
+// handed to the VM.
+static Chunk* loadingChunk = NULL;
+
+void markBytecodeRoots(){
+  if(loadingChunk == NULL) return;
+  for(int i = 0; i < loadingChunk->constants.count; i++){
+    markValue(loadingChunk->constants.values[i]);
+  }
+}
+
+static const char* readConstants(Reader* reader, Chunk* chunk,
+                                 uint32_t count){
+  for(uint32_t i = 0; i < count; i++){
+    uint8_t tag;
+    if(!readBytes(reader, &tag, 1)) return "truncated constants";
+    switch(tag){
+      case CONSTANT_NUMBER: {
+        double number;
+        if(!readBytes(reader, &number, sizeof(number))){
+          return "truncated constants";
+        }
+        addConstant(chunk, NUMBER_VAL(number));
+        break;
+      }
+      case CONSTANT_STRING: {
+        ObjString* string = readString(reader);
+        if(string == NULL) return "truncated constants";
+        addConstant(chunk, OBJ_VAL(string));
+        break;
+      }
+      default:
+        return "unknown constant tag";
+    }
+  }
+  return NULL;
+}
+
+// Resolves the file's global names in this VM and rewrites the operands
+// of any that moved. A fresh VM hands out slots in the same order the
+// compiling one did, so this is usually a no-op.
+static const char* linkGlobals(Reader* reader, Chunk* chunk,
+                               uint32_t count){
+  // Each name takes at least its length field.
+  if(count > (size_t)(reader->end - reader->current) / sizeof(uint32_t)){
+    return "truncated globals";
+  }
+
+  int* slots = malloc(sizeof(int) * (count + 1));
+  bool moved = false;
+  for(uint32_t i = 0; i < count; i++){
+    ObjString* name = readString(reader);
+    if(name == NULL){
+      free(slots);
+      return "truncated globals";
+    }
+    slots[i] = globalSlot(name);
+    if(slots[i] != (int)i) moved = true;
+  }
+
+  const char* error = checkCode(chunk, (int)count);
+  for(int offset = 0; error == NULL && moved && offset < chunk->count;){
+    uint8_t* code = &chunk->code[offset];
+    int global, constant;
+    bool wide;
+    decodeOperands(code, &global, &constant, &wide);
+    if(global >= 0){
+      int slot = slots[global];
+      if(wide){
+        code[1] = (slot >> 16) & 0xff;
+        code[2] = (slot >> 8) & 0xff;
+        code[3] = slot & 0xff;
+      } else if(slot <= UINT8_MAX){
+        code[1] = (uint8_t)slot;
+      } else {
+        error = "global slot does not fit its operand";
+      }
+    }
+    offset += opcodeLength(code[0]);
+  }
+  free(slots);
+  return error;
+}
+
+static const char* readBytecode(uint8_t* data, size_t size, Chunk* chunk){
+  BytecodeHeader header;
+  if(size < sizeof(header)) return "truncated header";
+  memcpy(&header, data, sizeof(header));
+  if(memcmp(header.magic, BYTECODE_MAGIC, sizeof(header.magic)) != 0){
+    return "not a bytecode file";
+  }
+  if(header.version != BYTECODE_VERSION) return "unsupported version";
+  if(header.byteOrder != BYTE_ORDER_MARK) return "wrong byte order";
+  if(header.codeLength > INT_MAX || header.lineCount > INT_MAX){
+    return "code too large";
+  }
+
+  size_t linesStart = linesOffset(header.codeLength);
+  if(linesStart > size ||
+     (size - linesStart) / sizeof(LineStart) < header.lineCount){
+    return "truncated code";
+  }
+
+  chunk->code = data + sizeof(header);
+  chunk->count = chunk->capacity = (int)header.codeLength;
+  chunk->lines = (LineStart*)(data + linesStart);
+  chunk->lineCount = chunk->lineCapacity = (int)header.lineCount;
+
+  const char* error = checkLines(chunk);
+  if(error != NULL) return error;
+
+  Reader reader;
+  reader.current = (uint8_t*)&chunk->lines[chunk->lineCount];
+  reader.end = data + size;
+  error = readConstants(&reader, chunk, header.constantCount);
+  if(error != NULL) return error;
+  error = linkGlobals(&reader, chunk, header.globalCount);
+  if(error != NULL) return error;
+
+  if(reader.current != reader.end) return "trailing bytes";
+  return NULL;
+}
+
+static const char* mapBytecode(const char* path, Chunk* chunk,
+                               Mapping* mapping){
+  initChunk(chunk);
+  mapping->data = NULL;
+  mapping->size = 0;
+
+  int fd = open(path, O_RDONLY);
+  if(fd < 0) return "could not open file";
+
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BytecodeHeader)){
+    close(fd);
+    return "truncated header";
+  }
+
+  // Private and writable, so relinking globals touches only our copy of
+  // the pages it changes.
+  void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) return "could not map file";
+  mapping->data = data;
+  mapping->size = st.st_size;
+
+  loadingChunk = chunk;
+  const char* error = readBytecode(data, mapping->size, chunk);
+  loadingChunk = NULL;
+  if(error != NULL) unloadBytecode(chunk, mapping);
+  return error;
+}
+
+bool loadBytecode(const char* path, Chunk* chunk, Mapping* mapping){
+  const char* error = mapBytecode(path, chunk, mapping);
+  if(error != NULL){
+    fprintf(stderr, "Invalid bytecode file \"%s\": %s.\n", path, error);
+    return false;
+  }
+  return true;
+}
+
+// Same as loadBytecode() without the error message, for callers that
+// have the source to fall back on.
+bool tryLoadBytecode(const char* path, Chunk* chunk, Mapping* mapping){
+  return mapBytecode(path, chunk, mapping) == NULL;
+}
+
+// The code and line table belong to the mapping, only the constant pool
+// was allocated.
+void unloadBytecode(Chunk* chunk, Mapping* mapping){
+  freeValueArray(&chunk->constants);
+  initChunk(chunk);
+  if(mapping->data != NULL) munmap(mapping->data, mapping->size);
+  mapping->data = NULL;
+  mapping->size = 0;
+}
@@ -4,122 +4,261 @@
 #include "object.h"
 #include <string.h>
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef USE_SSE2
+#include <emmintrin.h>
+#endif
+
+/*
+Swiss table. Next to the entries sits one control byte per slot: the top
+7 bits of the key's hash when the slot is full, or EMPTY or DELETED.
+The slots are split into groups of 16. A lookup starts at the group the
+low bits of the hash pick and compares all 16 control bytes with the
+key's 7 bits at once, so only entries that are very likely the key are
+ever touched. A group with an EMPTY slot ends the search. Groups are
+probed quadratically, which with a power of two group count visits
+every one of them.
+
+Deleting leaves a DELETED marker only when the group is full, because
+then a probe may have gone past it. The next tableSet() that finds the
+table too full, or mostly empty, rehashes it into the right size, which
+also clears every DELETED. Resizing never happens on delete, so
+tableRemoveWhite() can run in the middle of a collection without
+allocating.
+*/
+
+#define GROUP_SIZE 16
+#define MIN_CAPACITY GROUP_SIZE
+
+// Full slots hold 0 to 127, the free ones have the top bit set.
+#define EMPTY 0x80
+#define DELETED 0xfe
+
+#ifdef USE_SSE2
+typedef __m128i Group;
+
+static inline Group loadGroup(const uint8_t* control){
+  return _mm_loadu_si128((const __m128i*)control);
+}
+
+static inline uint32_t matchByte(Group group, uint8_t byte){
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+}
+
+// EMPTY or DELETED, both have the sign bit set.
+static inline uint32_t matchFree(Group group){
+  return _mm_movemask_epi8(group);
+}
+#else
+// Scalar fallback, one byte at a time.
+typedef const uint8_t* Group;
+
+static inline Group loadGroup(const uint8_t* control){
+  return control;
+}
+
+static inline uint32_t matchByte(Group group, uint8_t byte){
+  uint32_t mask = 0;
+  for(int i = 0; i < GROUP_SIZE; i++){
+    if(group[i] == byte) mask |= 1u << i;
+  }
+  return mask;
+}
+
+static inline uint32_t matchFree(Group group){
+  uint32_t mask = 0;
+  for(int i = 0; i < GROUP_SIZE; i++){
+    if(group[i] & 0x80) mask |= 1u << i;
+  }
+  return mask;
+}
+#endif
+
+static inline uint8_t hashTag(uint32_t hash){
+  return (uint8_t)(hash >> 25);
+}
+
+// Past this many full or DELETED slots the table is rehashed.
+static inline int maxLoad(int capacity){
+  return capacity - capacity / 8;
+}
+
+// The entries and the control bytes share one allocation.
+static size_t tableBytes(int capacity){
+  return (size_t)capacity * (sizeof(Entry) + 1);
+}
 
 void initTable(Table* table){
   table->count = 0;
+  table->deleted = 0;
   table->capacity = 0;
   table->entries = NULL;
+  table->control = NULL;
 }
 
 void freeTable(Table* table){
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  if(table->capacity > 0){
+    reallocate(table->entries, tableBytes(table->capacity), 0);
+  }
   initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key){
-  uint32_t index = key->hash % capacity;
-  Entry* tombstone = NULL;
-  for(;;){
-    Entry* entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
+// Index of the key's slot, or -1.
+static int findSlot(Table* table, ObjString* key){
+  if(table->count == 0) return -1;
+  uint32_t groupMask = table->capacity / GROUP_SIZE - 1;
+  uint32_t group = key->hash & groupMask;
+  uint8_t tag = hashTag(key->hash);
+
+  for(uint32_t step = 1;; step++){
+    int base = group * GROUP_SIZE;
+    Group control = loadGroup(&table->control[base]);
+    for(uint32_t match = matchByte(control, tag); match != 0;
+        match &= match - 1){
+      int slot = base + lowestBit(match);
+      if(table->entries[slot].key == key) return slot;
     }
-    index = (index + 1) % capacity;
+    if(matchByte(control, EMPTY) != 0) return -1;
+    group = (group + step) & groupMask;
   }
 }
 
-static void adjustCapacity(Table *table, int capacity){
-  Entry* entries = ALLOCATE(Entry, capacity);
-  for(int i=0; i<capacity; i++){
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+// First EMPTY or DELETED slot on the hash's probe sequence.
+static int findFree(uint8_t* controlBytes, int capacity, uint32_t hash){
+  uint32_t groupMask = capacity / GROUP_SIZE - 1;
+  uint32_t group = hash & groupMask;
+  for(uint32_t step = 1;; step++){
+    int base = group * GROUP_SIZE;
+    uint32_t free = matchFree(loadGroup(&controlBytes[base]));
+    if(free != 0) return base + lowestBit(free);
+    group = (group + step) & groupMask;
   }
-  table->count = 0;
-  for (int i = 0; i < table->capacity; i++) {
-    Entry* entry = &table->entries[i];
-    if (entry->key == NULL) continue;
+}
+
+static void resize(Table* table, int capacity){
+  Entry* entries = reallocate(NULL, 0, tableBytes(capacity));
+  uint8_t* control = (uint8_t*)(entries + capacity);
+  memset(control, EMPTY, capacity);
 
-    Entry* dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+  // Allocating may have collected and emptied some of vm.strings, so the
+  // old table is only read from here on.
+  int count = 0;
+  for(int i = 0; i < table->capacity; i++){
+    if(table->control[i] & 0x80) continue;
+    Entry* entry = &table->entries[i];
+    int slot = findFree(control, capacity, entry->key->hash);
+    control[slot] = table->control[i];
+    entries[slot] = *entry;
+    count++;
+  }
+  if(table->capacity > 0){
+    reallocate(table->entries, tableBytes(table->capacity), 0);
   }
-  FREE_ARRAY(Entry, table->entries, table->capacity);
   table->entries = entries;
+  table->control = control;
   table->capacity = capacity;
+  table->count = count;
+  table->deleted = 0;
+}
+
+// The capacity a table with count entries is rehashed into: at most half
+// full afterwards, so it doesn't have to grow again right away.
+static int capacityFor(int count){
+  int capacity = MIN_CAPACITY;
+  while(capacity / 2 < count) capacity *= 2;
+  return capacity;
 }
 
 bool tableSet(Table* table, ObjString* key, Value value){
-  if(table->count + 1 > table->capacity * TABLE_MAX_LOAD){
-    int capacity = GROW_CAPACITY(table->capacity);
-    adjustCapacity(table, capacity);
+  int slot = findSlot(table, key);
+  if(slot >= 0){
+    table->entries[slot].value = value;
+    return false;
+  }
+
+  if(table->count + table->deleted + 1 > maxLoad(table->capacity) ||
+     (table->capacity > MIN_CAPACITY && table->count < table->capacity / 8)){
+    resize(table, capacityFor(table->count + 1));
   }
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+
+  slot = findFree(table->control, table->capacity, key->hash);
+  if(table->control[slot] == DELETED) table->deleted--;
+  table->control[slot] = hashTag(key->hash);
+  table->entries[slot].key = key;
+  table->entries[slot].value = value;
+  table->count++;
+  return true;
 }
 
 void tableAddAll(Table* from, Table* to){
-  for(int i=0; i<from->capacity; i++){
-    Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
-    }
+  for(int i = 0; i < from->capacity; i++){
+    if(from->control[i] & 0x80) continue;
+    tableSet(to, from->entries[i].key, from->entries[i].value);
   }
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
-  if (table->count == 0) return false;
-
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
-
-  *value = entry->value;
+  int slot = findSlot(table, key);
+  if(slot < 0) return false;
+  *value = table->entries[slot].value;
   return true;
 }
 
-bool tableDelete(Table* table, ObjString* key) {
-  if (table->count == 0) return false;
-
-  // Find the entry.
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+static void removeSlot(Table* table, int slot){
+  int base = slot & ~(GROUP_SIZE - 1);
+  // A group that still has an EMPTY slot never sent a probe further.
+  if(matchByte(loadGroup(&table->control[base]), EMPTY) != 0){
+    table->control[slot] = EMPTY;
+  } else {
+    table->control[slot] = DELETED;
+    table->deleted++;
+  }
+  table->entries[slot].key = NULL;
+  table->count--;
+}
 
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+bool tableDelete(Table* table, ObjString* key) {
+  int slot = findSlot(table, key);
+  if(slot < 0) return false;
+  removeSlot(table, slot);
   return true;
 }
+
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash) {
   if (table->count == 0) return NULL;
+  uint32_t groupMask = table->capacity / GROUP_SIZE - 1;
+  uint32_t group = hash & groupMask;
+  uint8_t tag = hashTag(hash);
 
-  uint32_t index = hash % table->capacity;
-  for (;;) {
-    Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length &&
-        entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
+  for(uint32_t step = 1;; step++){
+    int base = group * GROUP_SIZE;
+    Group control = loadGroup(&table->control[base]);
+    for(uint32_t match = matchByte(control, tag); match != 0;
+        match &= match - 1){
+      ObjString* key = table->entries[base + lowestBit(match)].key;
+      if(key->length == length && key->hash == hash &&
+         memcmp(key->chars, chars, length) == 0){
+        return key;
+      }
     }
+    if(matchByte(control, EMPTY) != 0) return NULL;
+    group = (group + step) & groupMask;
+  }
+}
+
+// vm.strings only holds its keys weakly. Strings nothing else marked are
+// about to be swept, so their entries go first.
+void tableRemoveWhite(Table* table){
+  for(int i = 0; i < table->capacity; i++){
+    if(table->control[i] & 0x80) continue;
+    if(!table->entries[i].key->obj.isMarked) removeSlot(table, i);
+  }
+}
 
-    index = (index + 1) % table->capacity;
+void markTable(Table* table){
+  for(int i = 0; i < table->capacity; i++){
+    if(table->control[i] & 0x80) continue;
+    markObject((Obj*)table->entries[i].key);
+    markValue(table->entries[i].value);
   }
 }
@@ -26,3 +26,30 @@ void freeValueArray(ValueArray* valueArray){
  initValueArray(valueArray);
 }
 
+
+bool valuesEqual(Value a, Value b){
+#ifdef NAN_BOXING
+  // NaN != NaN, so numbers can't be compared bit for bit.
+  if(IS_NUMBER(a) && IS_NUMBER(b)){
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  // Runtime strings are not interned, see newString().
+  if(IS_STRING(a) && IS_STRING(b)){
+    return stringsEqual(AS_STRING(a), AS_STRING(b));
+  }
+  return a == b;
+#else
+  if(a.type != b.type) return false;
+  switch(a.type){
+    case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_NIL: return true;
+    case VAL_OBJ:
+      if(IS_STRING(a) && IS_STRING(b)){
+        return stringsEqual(AS_STRING(a), AS_STRING(b));
+      }
+      return AS_OBJ(a) == AS_OBJ(b);
+    default: return false;
+  }
+#endif
+}
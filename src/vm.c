@@ -1,24 +1,59 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include "debug.h"
 #include "compiler.h"
+#include "marker.h"
 #include "memory.h"
 #include "vm.h"
 
+#ifdef DEBUG_STATS
+#include <time.h>
+#endif
+
+// Threaded dispatch relies on the labels-as-values extension that GCC and
+// Clang provide. Build with -DNO_COMPUTED_GOTO to get the portable switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 VM vm; // We only need one VM so its easier to pass it around
 
+#ifdef DEBUG_STATS
+typedef struct {
+  uint64_t instructions;
+  // pairs[a][b] counts b dispatched right after a. Row OPCODE_COUNT is
+  // the start of a run, which has no predecessor.
+  uint64_t pairs[OPCODE_COUNT + 1][OPCODE_COUNT];
+  uint8_t previous;
+} Stats;
+
+static Stats stats;
+#endif
+
 static InterpretResult run();
-static void runTimeError(const char*);
-bool isFalsey(Value value);
-bool valuesEqual(Value a, Value b);
+static void runTimeError(const char* format, ...);
+static void resetStack();
 
 void push(Value value){
   *vm.stackTop = value;
   vm.stackTop++; // move the stack pointer
 }
 
-static void runTimeError(const char* message){
-  fprintf(stderr, "%s", message);
+static void runTimeError(const char* format, ...){
+  va_list args;
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputs("\n", stderr);
+
+  // ip has already moved past the failing instruction's opcode.
+  size_t instruction = vm.ip - vm.chunk->code - 1;
+  fprintf(stderr, "[line %d] in script\n",
+          getLine(vm.chunk, (int)instruction));
+  // The next chunk's locals are addressed from the bottom of the stack.
+  resetStack();
 }
 
 Value peek(int distance){
@@ -34,44 +69,249 @@ static void resetStack(){
   vm.stackTop = vm.stack; // point stack pointer back to the start
 }
 
+// Makes room for count more values on top of the stack. The stack may
+// move, so nothing may hold a pointer into it across this.
+static void reserveStack(int count){
+  int needed = (int)(vm.stackTop - vm.stack) + count;
+  if(needed <= vm.stackCapacity) return;
+
+  int capacity = vm.stackCapacity;
+  while(capacity < needed) capacity *= 2;
+  // Plain realloc, like the gray stack, growing must not collect.
+  Value* stack = realloc(vm.stack, sizeof(Value) * capacity);
+  if(stack == NULL) exit(1);
+  vm.stackTop = stack + (vm.stackTop - vm.stack);
+  vm.stack = stack;
+  vm.stackCapacity = capacity;
+}
+
 void initVM(){
   vm.chunk = NULL;
   vm.ip = 0;
+  vm.stack = malloc(sizeof(Value) * STACK_INITIAL);
+  if(vm.stack == NULL) exit(1);
+  vm.stackCapacity = STACK_INITIAL;
   resetStack();
   vm.objects = NULL;
+  initHeap();
   initTable(&vm.strings);
-  initTable(&vm.globals);
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalNames);
+  initValueArray(&vm.globalValues);
 }
 
 void freeVM(){
-  freeTable(&vm.globals);
+  freeMarker();
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalNames);
+  freeValueArray(&vm.globalValues);
   freeTable(&vm.strings);
   freeObjects();
+  free(vm.stack);
+  vm.stack = NULL;
+  vm.stackCapacity = 0;
+}
+
+// Globals live in a flat array so the VM can address them by index. The
+// compiler asks for a slot the first time it sees a name, and the same
+// name always maps to the same slot, even across REPL lines.
+int globalSlot(ObjString* name){
+  Value slot;
+  if(tableGet(&vm.globalSlots, name, &slot)){
+    return (int)AS_NUMBER(slot);
+  }
+  int index = vm.globalValues.count;
+  push(OBJ_VAL(name));
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+  pop();
+  return index;
+}
+
+#ifdef DEBUG_STATS
+#define PROFILE_TOP 10
+
+// Prints the most frequent opcode pairs, which is where fusing two
+// handlers into a superinstruction saves the most dispatches. Each pair
+// is cleared once printed, the counts are reset on the next run anyway.
+static void printPairProfile(){
+  for(int i = 0; i < PROFILE_TOP; i++){
+    int bestA = 0, bestB = 0;
+    for(int a = 0; a < OPCODE_COUNT; a++){
+      for(int b = 0; b < OPCODE_COUNT; b++){
+        if(stats.pairs[a][b] > stats.pairs[bestA][bestB]){
+          bestA = a;
+          bestB = b;
+        }
+      }
+    }
+    uint64_t count = stats.pairs[bestA][bestB];
+    if(count == 0) return;
+    fprintf(stderr, "[stats] %-28s -> %-28s %10llu (%.1f%%)\n",
+            opcodeName(bestA), opcodeName(bestB),
+            (unsigned long long)count,
+            100.0 * count / stats.instructions);
+    stats.pairs[bestA][bestB] = 0;
+  }
+}
+#endif
+
+bool compileSource(const char* source, Chunk* chunk){
+  initChunk(chunk);
+  if(!compile(source, chunk)){
+    freeChunk(chunk);
+    return false;
+  }
+  return true;
 }
 
 InterpretResult interpret(const char* source){
   Chunk chunk;
-  initChunk(&chunk);
+  if(!compileSource(source, &chunk)) return INTERPRET_COMPILE_ERROR;
 
-  if(!compile(source, &chunk)){
-    freeChunk(&chunk);
-    return INTERPRET_COMPILE_ERROR;
-  }
+  InterpretResult result = interpretChunk(&chunk);
+  freeChunk(&chunk);
+  return result;
+}
 
-  
-  vm.chunk = &chunk;
+// Runs a chunk that was compiled or loaded earlier. The caller still
+// owns it.
+InterpretResult interpretChunk(Chunk* chunk){
+  // The one overflow check: the compiler, or the loader's validator,
+  // worked out how deep this chunk's code goes.
+  reserveStack(chunk->maxStack + STACK_HEADROOM);
+  vm.chunk = chunk;
   vm.ip = vm.chunk->code;
 
+#ifdef DEBUG_STATS
+  memset(&stats, 0, sizeof(stats));
+  stats.previous = OPCODE_COUNT;
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+#endif
+
   InterpretResult result = run();
+  // The marker thread reads this chunk's constants.
+  finishMarker();
 
-  freeChunk(&chunk);
+#ifdef DEBUG_STATS
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - begin.tv_sec) +
+                   (end.tv_nsec - begin.tv_nsec) / 1e9;
+  fprintf(stderr, "[stats] %llu instructions in %.6fs (%.2fM instr/s)\n",
+          (unsigned long long)stats.instructions, seconds,
+          seconds > 0 ? stats.instructions / seconds / 1e6 : 0.0);
+  fprintf(stderr, "[stats] Value %zu bytes, code %zu bytes, lines %zu bytes, "
+          "constants %zu bytes, globals %zu bytes, strings %zu bytes, "
+          "heap %zu bytes\n",
+          sizeof(Value),
+          (size_t)chunk->capacity,
+          chunk->lineCapacity * sizeof(LineStart),
+          chunk->constants.capacity * sizeof(Value),
+          vm.globalSlots.capacity * sizeof(Entry) +
+          vm.globalValues.capacity * sizeof(Value) * 2,
+          vm.strings.capacity * sizeof(Entry),
+          vm.bytesAllocated);
+  printPairProfile();
+  printGCStats();
+#endif
+
+#ifdef DEBUG_PRINT_CODE
+  for(int offset = 0; chunk->feedback != NULL && offset < chunk->count;
+      offset++){
+    if(chunk->feedback[offset] != 0){
+      disassembleChunk(chunk, "quickened");
+      break;
+    }
+  }
+#endif
+
+  free(chunk->feedback);
+  chunk->feedback = NULL;
+  vm.chunk = NULL;
   return result;
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(){
+  printf("          ");
+  //for(Value* slot = vm.stack; slot < vm.stackTop; slot ++){
+  // less fancy
+  for (int i = 0; i < (vm.stackTop - vm.stack); i++) {
+    printf("[ ");
+    printValue(vm.stack[i]);
+    printf(" ]");
+  }
+  printf("\n");
+  // Pointer arithmetic to get offset from the start of the opcode
+  disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+}
+#endif
+
+// Ropes are compared by their characters, so they are put together
+// before an equality test. The stack slot keeps the rope reachable while
+// that allocates.
+static inline void flattenOperand(int distance){
+  Value* slot = &vm.stackTop[-1 - distance];
+  if(IS_ROPE(*slot)) *slot = OBJ_VAL(flattenRope(slot));
+}
+
+static bool concatenateParts(int count);
+
+/*
+Quickening. The generic OP_ADD, OP_EQUAL and OP_NOT_EQUAL note the kind
+of operands they see in the chunk's feedback byte for their offset. When
+a site runs again and has still only seen numbers, or only strings, its
+opcode is rewritten in place to the specialized form, whose one guard
+replaces the generic type dispatch. Code that runs once, most of a
+straight line script, is left alone, rewriting it would only cost a
+copied page in a mapped chunk.
+
+There are no functions yet, so nothing runs twice before a loop jumps
+back. The feedback bytes are only allocated then, which keeps a script
+without loops from touching a page of them per page of code.
+
+A guard that fails writes the generic opcode back and runs that instead,
+and since the site has now seen two kinds it stays generic rather than
+flipping back and forth. Loaded chunks are mapped copy on write, so the
+rewrite never reaches the file.
+*/
+static inline uint8_t operandKind(Value a, Value b){
+  if(IS_NUMBER(a) && IS_NUMBER(b)) return FEEDBACK_NUMBER;
+  if(IS_ANY_STRING(a) && IS_ANY_STRING(b)) return FEEDBACK_STRING;
+  return FEEDBACK_OTHER;
+}
+
+static inline void startFeedback(){
+  if(vm.chunk->feedback != NULL) return;
+  vm.chunk->feedback = calloc(vm.chunk->count, sizeof(uint8_t));
+  if(vm.chunk->feedback == NULL) exit(1);
+}
+
+static inline void quicken(uint8_t* instruction, uint8_t numberOp,
+                           uint8_t stringOp){
+  if(vm.chunk->feedback == NULL) return;
+  uint8_t* feedback = &vm.chunk->feedback[instruction - vm.chunk->code];
+  bool warm = *feedback & FEEDBACK_WARM;
+  *feedback |= operandKind(peek(1), peek(0)) | FEEDBACK_WARM;
+  if(!warm) return;
+  uint8_t seen = *feedback & FEEDBACK_KINDS;
+  if(seen == FEEDBACK_NUMBER) *instruction = numberOp;
+  else if(seen == FEEDBACK_STRING) *instruction = stringOp;
+}
+
 static InterpretResult run(){
 #define READ_BYTE() (*vm.ip++)
 #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_LONG() (vm.ip += 3, readUint24(vm.ip - 3))
+#define READ_SHORT() (vm.ip += 2, readUint16(vm.ip - 2))
+#define READ_CONSTANT_LONG() (vm.chunk->constants.values[READ_LONG()])
+#define READ_GLOBAL() (vm.globalValues.values[READ_BYTE()])
+#define READ_GLOBAL_LONG() (vm.globalValues.values[READ_LONG()])
+#define GLOBAL_NAME(slot) \
+  AS_CSTRING(vm.globalNames.values[(slot) - vm.globalValues.values])
 
 #define BINARY_OP(valueType, op) \
   do { \
@@ -84,60 +324,249 @@ static InterpretResult run(){
     push(valueType(a op b)); \
   } while(false)
 
+#define ADD_OP() \
+  do { \
+    if(IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))){ \
+      double b = AS_NUMBER(pop()); \
+      vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) + b); \
+    } else if(IS_ANY_STRING(peek(0)) && IS_ANY_STRING(peek(1))){ \
+      concatenate(); \
+    } \
+    else { \
+      runTimeError( \
+        "Operands must be two numbers or strings" \
+      ); \
+      return INTERPRET_RUNTIME_ERROR; \
+    } \
+  } while(false)
+
+// Declares `global` pointing at the slot named by the next operand,
+// raising a runtime error if the global was never defined.
+#define DEFINED_GLOBAL(global, slot) \
+  Value* global = &slot; \
+  if (IS_UNDEFINED(*global)) { \
+    runTimeError("Undefined variable '%s'", GLOBAL_NAME(global)); \
+    return INTERPRET_RUNTIME_ERROR; \
+  }
+#define READ_DEFINED_GLOBAL(global) DEFINED_GLOBAL(global, READ_GLOBAL())
+#define READ_DEFINED_GLOBAL_LONG(global) \
+  DEFINED_GLOBAL(global, READ_GLOBAL_LONG())
+
+// Every write to a global slot goes through here. A young value in a
+// slot is a reference the nursery collector has to know about, and while
+// a concurrent mark runs the overwritten value has to be logged.
+#define STORE_GLOBAL(global, value) \
+  do { \
+    Value stored = (value); \
+    if(IS_OBJ(stored) && isYoung(AS_OBJ(stored))){ \
+      rememberGlobal((int)((global) - vm.globalValues.values)); \
+    } \
+    if(vm.marking) storeGlobalWhileMarking(global, stored); \
+    else *(global) = stored; \
+  } while(false)
+
+// Pops two numbers and jumps when `a op b` comes out as taken. The offset
+// is read either way so a fall through lands on the next instruction.
+#define COMPARE_JUMP(op, taken) \
+  do { \
+    if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+        runTimeError("Operands must be numbers"); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } \
+    double b = AS_NUMBER(pop()); \
+    double a = AS_NUMBER(pop()); \
+    uint16_t offset = READ_SHORT(); \
+    if((a op b) == (taken)) vm.ip += offset; \
+  } while(false)
+
+#define EQUAL_JUMP(taken) \
+  do { \
+    flattenOperand(0); \
+    flattenOperand(1); \
+    Value b = pop(); \
+    Value a = pop(); \
+    uint16_t offset = READ_SHORT(); \
+    if(valuesEqual(a, b) == (taken)) vm.ip += offset; \
+  } while(false)
+
+// For a quickened instruction whose guard failed: puts the generic
+// opcode back and dispatches to it. Not wrapped in do/while, since the
+// switch form of DISPATCH() is a continue.
+#define DESPECIALIZE(generic) \
+  { \
+    vm.ip[-1] = (generic); \
+    vm.ip--; \
+    DISPATCH(); \
+  }
+
+#define GLOBAL_CONSTANT_OP(op) \
+  do { \
+    READ_DEFINED_GLOBAL(global); \
+    push(*global); \
+    push(READ_CONSTANT()); \
+    op; \
+  } while(false)
+
+// Runs before every instruction is fetched, in both dispatch modes.
+#if defined(DEBUG_TRACE_EXECUTION)
+#define BEFORE_DISPATCH() do { COUNT_INSTRUCTION(); traceExecution(); } while(false)
+#else
+#define BEFORE_DISPATCH() COUNT_INSTRUCTION()
+#endif
+
+#ifdef DEBUG_STATS
+#define COUNT_INSTRUCTION() \
+  do { \
+    stats.instructions++; \
+    stats.pairs[stats.previous][*vm.ip]++; \
+    stats.previous = *vm.ip; \
+  } while(false)
+#else
+#define COUNT_INSTRUCTION() ((void)0)
+#endif
+
+/*
+With COMPUTED_GOTO every handler ends in its own indirect jump through
+dispatchTable, so the branch predictor gets one history per opcode instead
+of a single shared one for the whole switch. Handlers are written once
+with CASE()/DISPATCH() and expand to either form.
+*/
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+    [OP_CONSTANT]      = &&label_OP_CONSTANT,
+    [OP_NEGATE]        = &&label_OP_NEGATE,
+    [OP_ADD]           = &&label_OP_ADD,
+    [OP_SUBTRACT]      = &&label_OP_SUBTRACT,
+    [OP_MULTIPLY]      = &&label_OP_MULTIPLY,
+    [OP_DIVIDE]        = &&label_OP_DIVIDE,
+    [OP_NIL]           = &&label_OP_NIL,
+    [OP_TRUE]          = &&label_OP_TRUE,
+    [OP_FALSE]         = &&label_OP_FALSE,
+    [OP_RETURN]        = &&label_OP_RETURN,
+    [OP_NOT]           = &&label_OP_NOT,
+    [OP_EQUAL]         = &&label_OP_EQUAL,
+    [OP_GREATER]       = &&label_OP_GREATER,
+    [OP_LESS]          = &&label_OP_LESS,
+    [OP_PRINT]         = &&label_OP_PRINT,
+    [OP_POP]           = &&label_OP_POP,
+    [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+    [OP_GET_GLOBAL]    = &&label_OP_GET_GLOBAL,
+    [OP_SET_GLOBAL]    = &&label_OP_SET_GLOBAL,
+    [OP_NOT_EQUAL]     = &&label_OP_NOT_EQUAL,
+    [OP_DEFINE_GLOBAL_KEEP] = &&label_OP_DEFINE_GLOBAL_KEEP,
+    [OP_SET_GLOBAL_POP]          = &&label_OP_SET_GLOBAL_POP,
+    [OP_ADD_SET_GLOBAL_POP]      = &&label_OP_ADD_SET_GLOBAL_POP,
+    [OP_SUBTRACT_SET_GLOBAL_POP] = &&label_OP_SUBTRACT_SET_GLOBAL_POP,
+    [OP_GLOBAL_ADD_CONSTANT]      = &&label_OP_GLOBAL_ADD_CONSTANT,
+    [OP_GLOBAL_SUBTRACT_CONSTANT] = &&label_OP_GLOBAL_SUBTRACT_CONSTANT,
+    [OP_GLOBAL_MULTIPLY_CONSTANT] = &&label_OP_GLOBAL_MULTIPLY_CONSTANT,
+    [OP_GLOBAL_DIVIDE_CONSTANT]   = &&label_OP_GLOBAL_DIVIDE_CONSTANT,
+    [OP_CONSTANT_LONG]      = &&label_OP_CONSTANT_LONG,
+    [OP_DEFINE_GLOBAL_LONG] = &&label_OP_DEFINE_GLOBAL_LONG,
+    [OP_GET_GLOBAL_LONG]    = &&label_OP_GET_GLOBAL_LONG,
+    [OP_SET_GLOBAL_LONG]    = &&label_OP_SET_GLOBAL_LONG,
+    [OP_CONCAT_N]           = &&label_OP_CONCAT_N,
+    [OP_GET_LOCAL]          = &&label_OP_GET_LOCAL,
+    [OP_SET_LOCAL]          = &&label_OP_SET_LOCAL,
+    [OP_POPN]               = &&label_OP_POPN,
+    [OP_SET_LOCAL_POP]      = &&label_OP_SET_LOCAL_POP,
+    [OP_JUMP]               = &&label_OP_JUMP,
+    [OP_LOOP]               = &&label_OP_LOOP,
+    [OP_JUMP_IF_FALSE]      = &&label_OP_JUMP_IF_FALSE,
+    [OP_POP_JUMP_IF_FALSE]  = &&label_OP_POP_JUMP_IF_FALSE,
+    [OP_JUMP_IF_LESS]       = &&label_OP_JUMP_IF_LESS,
+    [OP_JUMP_IF_NOT_LESS]   = &&label_OP_JUMP_IF_NOT_LESS,
+    [OP_JUMP_IF_GREATER]    = &&label_OP_JUMP_IF_GREATER,
+    [OP_JUMP_IF_NOT_GREATER] = &&label_OP_JUMP_IF_NOT_GREATER,
+    [OP_JUMP_IF_EQUAL]      = &&label_OP_JUMP_IF_EQUAL,
+    [OP_JUMP_IF_NOT_EQUAL]  = &&label_OP_JUMP_IF_NOT_EQUAL,
+    [OP_FOR_STEP]           = &&label_OP_FOR_STEP,
+    [OP_ADD_NUM]            = &&label_OP_ADD_NUM,
+    [OP_ADD_STR]            = &&label_OP_ADD_STR,
+    [OP_EQUAL_NUM]          = &&label_OP_EQUAL_NUM,
+    [OP_NOT_EQUAL_NUM]      = &&label_OP_NOT_EQUAL_NUM,
+  };
+
+#define CASE(op) label_##op
+#define DISPATCH() \
+  do { BEFORE_DISPATCH(); goto *dispatchTable[READ_BYTE()]; } while(false)
+
+  DISPATCH();
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+
   for(;;){
-#ifdef DEBUG_TRACE_EXECUTION
-printf("          ");
-//for(Value* slot = vm.stack; slot < vm.stackTop; slot ++){
-// less fancy
-for (int i = 0; i < (vm.stackTop - vm.stack); i++) {
-  printf("[ ");
-  printValue(vm.stack[i]);
-  printf(" ]");
-}
-printf("\n");
-// Pointer arithmetic to get offset from the start of the opcode
-disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+    BEFORE_DISPATCH();
+    switch(READ_BYTE()){
 #endif
-    uint8_t instruction;
-    switch(instruction = READ_BYTE()){
-      case OP_RETURN: {
+      CASE(OP_RETURN): {
         return INTERPRET_OK;
       }
-      case OP_PRINT: {
+      CASE(OP_PRINT): {
         printValue(pop());
         printf("\n");
-        break;
+        DISPATCH();
       }
-      case OP_POP: {
+      CASE(OP_POP): {
         pop();
-        break;
+        DISPATCH();
       }
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
+      CASE(OP_POPN): {
+        vm.stackTop -= READ_BYTE();
+        DISPATCH();
       }
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name);
-          runTimeError("Undefined variable");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      // A script's locals start at the bottom of the stack. The collector
+      // scans the stack in both of its pauses, stores here need no barrier.
+      CASE(OP_GET_LOCAL): {
+        push(vm.stack[READ_BYTE()]);
+        DISPATCH();
       }
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
-          runTimeError("Undefined variable");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
+      CASE(OP_SET_LOCAL): {
+        vm.stack[READ_BYTE()] = peek(0);
+        DISPATCH();
+      }
+      CASE(OP_SET_LOCAL_POP): {
+        Value value = pop();
+        vm.stack[READ_BYTE()] = value;
+        DISPATCH();
+      }
+      CASE(OP_DEFINE_GLOBAL): {
+        Value* global = &READ_GLOBAL();
+        STORE_GLOBAL(global, pop());
+        DISPATCH();
+      }
+      CASE(OP_DEFINE_GLOBAL_KEEP): {
+        Value* global = &READ_GLOBAL();
+        STORE_GLOBAL(global, peek(0));
+        DISPATCH();
+      }
+      CASE(OP_SET_GLOBAL): {
+        READ_DEFINED_GLOBAL(global);
+        STORE_GLOBAL(global, peek(0));
+        DISPATCH();
+      }
+      CASE(OP_GET_GLOBAL): {
+        READ_DEFINED_GLOBAL(global);
+        push(*global);
+        DISPATCH();
       }
-      case OP_NEGATE: {
+      CASE(OP_DEFINE_GLOBAL_LONG): {
+        Value* global = &READ_GLOBAL_LONG();
+        STORE_GLOBAL(global, pop());
+        DISPATCH();
+      }
+      CASE(OP_SET_GLOBAL_LONG): {
+        READ_DEFINED_GLOBAL_LONG(global);
+        STORE_GLOBAL(global, peek(0));
+        DISPATCH();
+      }
+      CASE(OP_GET_GLOBAL_LONG): {
+        READ_DEFINED_GLOBAL_LONG(global);
+        push(*global);
+        DISPATCH();
+      }
+      CASE(OP_NEGATE): {
         if(IS_NUMBER(peek(0))){
           push(NUMBER_VAL(AS_NUMBER(pop())*-1));
         } 
@@ -145,84 +574,311 @@ disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
           runTimeError("Unable to negate");
           return INTERPRET_RUNTIME_ERROR;
         }
-        break;
-      }
-      case OP_ADD:{
-          if(IS_STRING(peek(0)) && IS_STRING(peek(1))){
-            concatenate();
-          } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))){
-            BINARY_OP(NUMBER_VAL, +);
-          }
-          else {
-            runTimeError(
-              "Operands must be two numbers or strings\n"
-            );
-            return INTERPRET_RUNTIME_ERROR;
-          }
-          break;
-      }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-      case OP_CONSTANT: {
+        DISPATCH();
+      }
+      CASE(OP_ADD): {
+        quicken(vm.ip - 1, OP_ADD_NUM, OP_ADD_STR);
+        ADD_OP();
+        DISPATCH();
+      }
+      CASE(OP_ADD_NUM): {
+        if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DESPECIALIZE(OP_ADD);
+        double b = AS_NUMBER(pop());
+        vm.stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm.stackTop[-1]) + b);
+        DISPATCH();
+      }
+      CASE(OP_ADD_STR): {
+        if(!IS_ANY_STRING(peek(0)) || !IS_ANY_STRING(peek(1))){
+          DESPECIALIZE(OP_ADD);
+        }
+        concatenate();
+        DISPATCH();
+      }
+      CASE(OP_CONCAT_N): {
+        int count = READ_BYTE();
+        if(concatenateParts(count)) DISPATCH();
+        // Not all short strings, add the parts left to right the way the
+        // OP_ADDs this replaced would have.
+        Value* parts = vm.stackTop - count;
+        for(int i = 1; i < count; i++){
+          push(parts[0]);
+          push(parts[i]);
+          ADD_OP();
+          parts[0] = pop();
+        }
+        vm.stackTop = parts + 1;
+        DISPATCH();
+      }
+      CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+      CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+      CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+
+      // Superinstructions, emitted by the peephole pass. Each one does the
+      // work of the sequence it replaces in a single dispatch.
+      CASE(OP_SET_GLOBAL_POP): {
+        READ_DEFINED_GLOBAL(global);
+        STORE_GLOBAL(global, pop());
+        DISPATCH();
+      }
+      CASE(OP_ADD_SET_GLOBAL_POP): {
+        ADD_OP();
+        READ_DEFINED_GLOBAL(global);
+        STORE_GLOBAL(global, pop());
+        DISPATCH();
+      }
+      CASE(OP_SUBTRACT_SET_GLOBAL_POP): {
+        BINARY_OP(NUMBER_VAL, -);
+        READ_DEFINED_GLOBAL(global);
+        STORE_GLOBAL(global, pop());
+        DISPATCH();
+      }
+      CASE(OP_GLOBAL_ADD_CONSTANT):
+        GLOBAL_CONSTANT_OP(ADD_OP());
+        DISPATCH();
+      CASE(OP_GLOBAL_SUBTRACT_CONSTANT):
+        GLOBAL_CONSTANT_OP(BINARY_OP(NUMBER_VAL, -));
+        DISPATCH();
+      CASE(OP_GLOBAL_MULTIPLY_CONSTANT):
+        GLOBAL_CONSTANT_OP(BINARY_OP(NUMBER_VAL, *));
+        DISPATCH();
+      CASE(OP_GLOBAL_DIVIDE_CONSTANT):
+        GLOBAL_CONSTANT_OP(BINARY_OP(NUMBER_VAL, /));
+        DISPATCH();
+      CASE(OP_CONSTANT): {
         Value constant = READ_CONSTANT();
         push(constant);
-        break;
+        DISPATCH();
       }
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_NIL: push(NIL_VAL); break;
-      case OP_NOT: {
+      CASE(OP_CONSTANT_LONG): {
+        Value constant = READ_CONSTANT_LONG();
+        push(constant);
+        DISPATCH();
+      }
+      CASE(OP_FALSE): push(BOOL_VAL(false)); DISPATCH();
+      CASE(OP_TRUE): push(BOOL_VAL(true)); DISPATCH();
+      CASE(OP_NIL): push(NIL_VAL); DISPATCH();
+      CASE(OP_NOT): {
         Value value = pop();
         push(BOOL_VAL(isFalsey(value)));
-        break;
+        DISPATCH();
        }
-      case OP_EQUAL: {
+      CASE(OP_EQUAL): {
+        quicken(vm.ip - 1, OP_EQUAL_NUM, OP_EQUAL);
+        flattenOperand(0);
+        flattenOperand(1);
         Value a = pop();
         Value b = pop();
         push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+        DISPATCH();
        }
-      case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-      case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
+      CASE(OP_NOT_EQUAL): {
+        quicken(vm.ip - 1, OP_NOT_EQUAL_NUM, OP_NOT_EQUAL);
+        flattenOperand(0);
+        flattenOperand(1);
+        Value a = pop();
+        Value b = pop();
+        push(BOOL_VAL(!valuesEqual(a, b)));
+        DISPATCH();
+       }
+      CASE(OP_EQUAL_NUM): {
+        if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) DESPECIALIZE(OP_EQUAL);
+        double b = AS_NUMBER(pop());
+        vm.stackTop[-1] = BOOL_VAL(AS_NUMBER(vm.stackTop[-1]) == b);
+        DISPATCH();
+      }
+      CASE(OP_NOT_EQUAL_NUM): {
+        if(!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))){
+          DESPECIALIZE(OP_NOT_EQUAL);
+        }
+        double b = AS_NUMBER(pop());
+        vm.stackTop[-1] = BOOL_VAL(AS_NUMBER(vm.stackTop[-1]) != b);
+        DISPATCH();
+      }
+      CASE(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+      CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+      CASE(OP_JUMP): {
+        uint16_t offset = READ_SHORT();
+        vm.ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_LOOP): {
+        uint16_t offset = READ_SHORT();
+        startFeedback();
+        vm.ip -= offset;
+        DISPATCH();
+      }
+      CASE(OP_JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
+        if(isFalsey(peek(0))) vm.ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_POP_JUMP_IF_FALSE): {
+        uint16_t offset = READ_SHORT();
+        if(isFalsey(pop())) vm.ip += offset;
+        DISPATCH();
+      }
+      CASE(OP_JUMP_IF_LESS): COMPARE_JUMP(<, true); DISPATCH();
+      CASE(OP_JUMP_IF_NOT_LESS): COMPARE_JUMP(<, false); DISPATCH();
+      CASE(OP_JUMP_IF_GREATER): COMPARE_JUMP(>, true); DISPATCH();
+      CASE(OP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(>, false); DISPATCH();
+      CASE(OP_JUMP_IF_EQUAL): EQUAL_JUMP(true); DISPATCH();
+      CASE(OP_JUMP_IF_NOT_EQUAL): EQUAL_JUMP(false); DISPATCH();
+      CASE(OP_FOR_STEP): {
+        // Operands are read in place, so an error still points at the
+        // opcode.
+        uint8_t* operands = vm.ip;
+        Value* counter = &vm.stack[operands[0]];
+        uint8_t mode = operands[3];
+        Value bound = (mode & FOR_STEP_CONSTANT_BOUND)
+                        ? vm.chunk->constants.values[operands[2]]
+                        : vm.stack[operands[2]];
+        if(!IS_NUMBER(*counter) || !IS_NUMBER(bound)){
+          runTimeError("Operands must be numbers");
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        double i = AS_NUMBER(*counter) +
+                   AS_NUMBER(vm.chunk->constants.values[operands[1]]);
+        double n = AS_NUMBER(bound);
+        *counter = NUMBER_VAL(i);
+        vm.ip += 6;
+
+        bool again;
+        switch(mode & FOR_STEP_COMPARE){
+          case FOR_STEP_LESS: again = i < n; break;
+          case FOR_STEP_LESS_EQUAL: again = !(i > n); break;
+          case FOR_STEP_GREATER: again = i > n; break;
+          default: again = !(i < n); break;
+        }
+        if(again){
+          startFeedback();
+          vm.ip -= readUint16(&operands[4]);
+        }
+        DISPATCH();
+      }
+#ifndef COMPUTED_GOTO
     }
   }
+#endif
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_GLOBAL
+#undef GLOBAL_NAME
 #undef BINARY_OP
+#undef ADD_OP
+#undef DEFINED_GLOBAL
+#undef READ_DEFINED_GLOBAL
+#undef READ_DEFINED_GLOBAL_LONG
+#undef READ_LONG
+#undef READ_SHORT
+#undef COMPARE_JUMP
+#undef EQUAL_JUMP
+#undef READ_CONSTANT_LONG
+#undef READ_GLOBAL_LONG
+#undef GLOBAL_CONSTANT_OP
+#undef DESPECIALIZE
+#undef STORE_GLOBAL
+#undef BEFORE_DISPATCH
+#undef COUNT_INSTRUCTION
+#undef CASE
+#undef DISPATCH
 }
 
-void concatenate(){
-  ObjString* bString = AS_STRING(pop());
-  ObjString* aString = AS_STRING(pop());
+// A rope that was already flattened is replaced by its string, so the
+// new node does not keep the old children around.
+static void unwrapFlattened(int distance){
+  Value* slot = &vm.stackTop[-1 - distance];
+  if(IS_ROPE(*slot) && AS_ROPE(*slot)->flat != NULL){
+    *slot = OBJ_VAL(AS_ROPE(*slot)->flat);
+  }
+}
 
-  int length = aString->length + bString->length;
+static void replaceOperands(int count, Obj* result){
+  vm.stackTop -= count;
+  push(OBJ_VAL(result));
+}
 
+// Joins the count strings on top of the stack with one allocation. When a
+// part is not a string, is a rope, or is long enough that copying it on
+// every append would be quadratic, the stack is left alone and false is
+// returned.
+static bool concatenateParts(int count){
+  int length = 0;
+  for(int i = 0; i < count; i++){
+    Value part = peek(i);
+    if(!IS_STRING(part) || AS_STRING(part)->length >= ROPE_MIN_LENGTH){
+      return false;
+    }
+    length += AS_STRING(part)->length;
+  }
 
-  char* chars = ALLOCATE(char, length+1);
-  memcpy(chars, aString->chars, aString->length);
-  memcpy(chars + aString->length, bString->chars, bString->length);
+  ObjString* result = newString(length);
+  char* dest = result->chars;
+  for(int i = count - 1; i >= 0; i--){
+    ObjString* part = AS_STRING(peek(i));
+    memcpy(dest, part->chars, part->length);
+    dest += part->length;
+  }
+  finishString(result);
+  replaceOperands(count, (Obj*)result);
+  return true;
+}
 
-  chars[length] = '\0';
+/*
+Short results are copied into a new string. Longer ones become a rope
+node over the two operands, so `s = s + piece;` costs the same however
+long s already is. A short piece added to a rope that already ends in a
+short string is merged with that string instead, which keeps the leaves
+from all being tiny.
 
-  ObjString* result = takeString(chars, length);
+Allocating can run a collection that moves the operands, so they are
+only read from the stack afterwards.
+*/
+void concatenate(){
+  unwrapFlattened(0);
+  unwrapFlattened(1);
+  int length = stringLength(AS_OBJ(peek(0))) + stringLength(AS_OBJ(peek(1)));
 
-  push(OBJ_VAL(result));
-}
+  // Ropes are never shorter than ROPE_MIN_LENGTH, both sides are flat.
+  if(length < ROPE_MIN_LENGTH){
+    ObjString* result = newString(length);
+    ObjString* bString = AS_STRING(peek(0));
+    ObjString* aString = AS_STRING(peek(1));
+    memcpy(result->chars, aString->chars, aString->length);
+    memcpy(result->chars + aString->length, bString->chars, bString->length);
+    finishString(result);
+    replaceOperands(2, (Obj*)result);
+    return;
+  }
 
-bool isFalsey(Value value){
-  return IS_BOOL(value) && !AS_BOOL(value) || IS_NIL(value);
-}
+  if(IS_ROPE(peek(1)) && IS_STRING(peek(0))){
+    Obj* last = AS_ROPE(peek(1))->right;
+    int leafLength = stringLength(last) + AS_STRING(peek(0))->length;
+    if(last->type == OBJ_STRING && leafLength < ROPE_MIN_LENGTH){
+      ObjString* leaf = newString(leafLength);
+      ObjString* lastString = (ObjString*)AS_ROPE(peek(1))->right;
+      memcpy(leaf->chars, lastString->chars, lastString->length);
+      memcpy(leaf->chars + lastString->length, AS_CSTRING(peek(0)),
+             AS_STRING(peek(0))->length);
+      finishString(leaf);
+      push(OBJ_VAL(leaf));
 
-bool valuesEqual(Value a, Value b){
-  if(a.type != b.type) return false;
-  switch(a.type){
-    case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
-    case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-    case VAL_NIL: return true;
-    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
-    default: return false;
+      ObjRope* result = newRope();
+      result->left = AS_ROPE(peek(2))->left;
+      result->right = AS_OBJ(peek(0));
+      result->length = length;
+      replaceOperands(3, (Obj*)result);
+      return;
+    }
   }
+
+  ObjRope* result = newRope();
+  result->left = AS_OBJ(peek(1));
+  result->right = AS_OBJ(peek(0));
+  result->length = length;
+  replaceOperands(2, (Obj*)result);
 }
 
+bool isFalsey(Value value){
+  return IS_BOOL(value) && !AS_BOOL(value) || IS_NIL(value);
+}
@@ -11,15 +11,96 @@ typedef struct {
 
 const char* results1[] = {"10"};
 const char* results2[] = {"Breakky This is the good life", "Hola Como Estas ?"};
+const char* results3[] = {"10", "10", "redefined"};
+const char* results4[] = {
+  "10", "5", "3", "false", "true", "false", "true", "abc",
+  "true", "21", "true", "true", "5", "6"
+};
+const char* results5[] = {"299.5", "151", "1299.5", "st", "true"};
+const char* results6[] = {"precompiled", "42", "true"};
+const char* results7[] = {"true", "true", "false", "true"};
+const char* results8[] = {
+  "true", "false", "true",
+  "the quick brown fox jumps over the lazy dog, "
+  "the quick brown fox jumps over the lazy dog, "
+  "the quick brown fox jumps over the lazy dog, "
+  "the quick brown fox jumps over the lazy dog, "
+  "the quick brown fox jumps over the lazy dog, "
+  "the quick brown fox jumps over the lazy dog, end"
+};
+const char* results9[] = {
+  "alpha beta alpha", "9", "alphabetaalphabeta", "true"
+};
+
+const char* results10[] = {
+  "a", "multi", "line"
+};
+
+const char* results11[] = {
+  "outer shadowed", "outer", "7", "global", "xyx"
+};
+
+const char* results12[] = {
+  "0", "1", "2", "0", "one", "2", "yes", "dflt", "2", "false", "90", "both",
+  "neg"
+};
+
+const char* results13[] = {
+  "6", "10", "9", "8", "7", "0", "0.5", "1", "0", "5", "6"
+};
+const char* results14[] = {
+  "3", "true", "3", "true", "3", "true", "ab", "false", "10.5", "false",
+  "false"
+};
+const char* results15[] = {
+  "300"
+};
+const char* results16[] = {
+  "3", "true", "3", "true", "3", "true", "ab", "false", "10.5", "false",
+  "false", "cache ./build/test_cache_warm", "hits 1", "misses 1"
+};
+const char* results17[] = {"6000", "1"};
 
 ResultMapEntry resultmapper[] = {
     {"./build/clox_test ./tests/scripts/test_1.clox", results1, 1},
-    {"./build/clox_test ./tests/scripts/test_2.clox", results2, 3}
+    {"./build/clox_test ./tests/scripts/test_2.clox", results2, 3},
+    {"./build/clox_test ./tests/scripts/test_3.clox", results3, 3},
+    {"./build/clox_test ./tests/scripts/test_4.clox", results4, 14},
+    {"./build/clox_test ./tests/scripts/test_5.clox", results5, 5},
+    {"./build/clox_test --compile ./tests/scripts/test_6.clox"
+     " -o ./build/test_6.cloxc && ./build/clox_test ./build/test_6.cloxc",
+     results6, 3},
+    {"./build/clox_test ./tests/scripts/test_7.clox", results7, 4},
+    {"./build/clox_test ./tests/scripts/test_8.clox", results8, 4},
+    {"./build/clox_test ./tests/scripts/test_9.clox", results9, 4},
+    {"./build/clox_test ./tests/scripts/test_10.clox", results10, 3},
+    {"./build/clox_test ./tests/scripts/test_11.clox", results11, 5},
+    {"./build/clox_test ./tests/scripts/test_12.clox", results12, 13},
+    {"./build/clox_test ./tests/scripts/test_13.clox", results13, 11},
+    {"./build/clox_test ./tests/scripts/test_14.clox", results14, 11},
+    {"./build/clox_test ./tests/scripts/test_15.clox", results15, 1},
+    // A second run of the same script comes from the cache.
+    {"rm -rf ./build/test_cache_warm &&"
+     " export CLOX_CACHE_DIR=./build/test_cache_warm &&"
+     " ./build/clox_test ./tests/scripts/test_14.clox > /dev/null &&"
+     " ./build/clox_test ./tests/scripts/test_14.clox &&"
+     " ./build/clox_test --cache-stats",
+     results16, 14},
+    // The second line checks that a concurrent mark did start.
+    {"./build/clox_test --gc-stats ./tests/scripts/test_16.clox"
+     " 2> ./build/test_16.err &&"
+     " grep -c 'initial mark [1-9]' ./build/test_16.err",
+     results17, 2}
 };
 
 int main(int argc, char** argv) {
   char buffer[1024];
 
+  // Keep the suite away from the user's own bytecode cache, and start
+  // from an empty one.
+  system("rm -rf ./build/test_cache");
+  setenv("CLOX_CACHE_DIR", "./build/test_cache", 1);
+
   size_t len = sizeof(resultmapper) / sizeof(resultmapper[0]);
 
   for(int i=0; i<len; i++) {